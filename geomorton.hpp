@@ -0,0 +1,388 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <stdint.h>
+#include <vector>
+#include <utility>
+
+#include <boost/unordered_map.hpp>
+
+#include "geoutil.hpp"
+#include "geotree.hpp"
+
+
+namespace geotools {
+    using namespace std;
+
+    // linear quadtree: points in an array sorted by morton code of GeoFixed lon/lat.
+    // a cell of level L is a contiguous range of codes sharing the top 2 * L bits.
+    // new points are buffered in a small array, also sorted, and merged in batches,
+    // erased points in the sorted array are tombstoned until the next merge, and counted
+    // by a fenwick tree so that cell counts stay O(log n).
+    template<class T>
+    class GeoMortonTree {
+    public:
+        typedef typename GeoTree<T>::Item Item;
+
+    private:
+        struct Entry {
+            uint64_t code;
+            T value;
+            float lon;
+            float lat;
+            bool dead;
+
+            Entry(uint64_t code, const T &value, GeoLonLat lonlat)
+                : code(code), value(value), lon(lonlat.lon), lat(lonlat.lat), dead(false)
+            {}
+
+            bool operator<(const Entry &rhs) const {
+                return this->code < rhs.code;
+            }
+        };
+
+        typedef boost::unordered_map<T, GeoLonLat> MapType;
+
+        vector<Entry> sorted;
+        vector<Entry> pending;      // sorted by code too, so cells are counted by binary search
+        size_t dead_count;      // tombstones in sorted
+        vector<uint32_t> dead_tree;     // fenwick tree of tombstones by index in sorted, empty if none
+        MapType geos;
+        uint32_t max_level;
+
+    public:
+        GeoMortonTree()
+            : sorted(), pending(), dead_count(0), dead_tree(), geos(), max_level(16)   // same as GeoTree::max_depth
+        {}
+
+        size_t size() const {
+            assert(this->geos.size() == this->sorted.size() - this->dead_count + this->pending.size());
+            return this->geos.size();
+        }
+
+        static bool is_valid(float lon, float lat) {
+            return GeoLonLat(lon, lat).is_valid();
+        }
+
+        bool insert(const T &value, float lon, float lat) {
+            assert(is_valid(lon, lat));
+
+            GeoLonLat lonlat(lon, lat);
+            typename MapType::iterator it = this->geos.find(value);
+            bool exists = it != this->geos.end();
+            if (exists) {
+                this->remove_entry(value, it->second);
+                it->second = lonlat;
+            } else {
+                this->geos.insert(make_pair(value, lonlat));
+            }
+
+            Entry entry(morton_code(lonlat), value, lonlat);
+            this->pending.insert(upper_bound(this->pending.begin(), this->pending.end(), entry), entry);
+            if (this->pending.size() > this->pending_limit()) {
+                this->merge();
+            }
+            return !exists;
+        }
+
+        bool insert(const Item &item) {
+            return insert(item.value, item.lon, item.lat);
+        }
+
+        bool erase(const T &value) {
+            typename MapType::iterator it = this->geos.find(value);
+            if (it == this->geos.end()) {
+                return false;
+            }
+
+            this->remove_entry(value, it->second);
+            this->geos.erase(it);
+            if (this->dead_count > this->sorted.size() / 8) {
+                this->merge();
+            }
+            return true;
+        }
+
+        // replace content with items of [first, last), later items win on duplicated values
+        template<class Iter>
+        void bulk_load(Iter first, Iter last) {
+            this->sorted.clear();
+            this->pending.clear();
+            this->dead_count = 0;
+            this->dead_tree.clear();
+            this->geos.clear();
+
+            this->geos.reserve(std::distance(first, last));
+            for (; first != last; ++first) {
+                const Item &item = *first;
+                assert(is_valid(item.lon, item.lat));
+                GeoLonLat lonlat(item.lon, item.lat);
+                pair<typename MapType::iterator, bool> itok = this->geos.insert(make_pair(item.value, lonlat));
+                if (!itok.second) {
+                    itok.first->second = lonlat;
+                }
+            }
+
+            this->sorted.reserve(this->geos.size());
+            for (typename MapType::const_iterator it = this->geos.begin(); it != this->geos.end(); ++it) {
+                this->sorted.push_back(Entry(morton_code(it->second), it->first, it->second));
+            }
+            sort(this->sorted.begin(), this->sorted.end());
+        }
+
+        vector<Item> get_nearby(
+            float lon, float lat, size_t count, uint32_t option = GEO_OPT_NONE) const
+        {
+            return nearby_impl(GeoLonLat(lon, lat), count, option);
+        }
+
+        uint32_t get_nearby_radius_by_count(float lon, float lat, size_t count) const {
+            vector<Item> items = get_nearby(lon, lat, count);
+            if (items.empty()) {
+                return 0;
+            } else {
+                return items.back().dist;
+            }
+        }
+
+        static uint64_t morton_code(GeoLonLat lonlat) {
+            return GeoFixed(lonlat).morton();
+        }
+
+    private:
+        size_t pending_limit() const {
+            return std::max<size_t>(256, sqrt(double(this->sorted.size())));
+        }
+
+        void remove_entry(const T &value, GeoLonLat lonlat) {
+            Entry key(morton_code(lonlat), value, lonlat);
+            typename vector<Entry>::iterator it = lower_bound(this->pending.begin(), this->pending.end(), key);
+            for (; it != this->pending.end() && it->code == key.code; ++it) {
+                if (it->value == value) {
+                    this->pending.erase(it);
+                    return;
+                }
+            }
+
+            it = lower_bound(this->sorted.begin(), this->sorted.end(), key);
+            for (; it != this->sorted.end() && it->code == key.code; ++it) {
+                if (!it->dead && it->value == value) {
+                    it->dead = true;
+                    this->dead_count++;
+                    this->add_dead(it - this->sorted.begin());
+                    return;
+                }
+            }
+            assert(!"unreachable");
+        }
+
+        // merge pending into sorted and drop tombstones
+        void merge() {
+            vector<Entry> merged;
+            merged.reserve(this->sorted.size() - this->dead_count + this->pending.size());
+
+            typename vector<Entry>::const_iterator a = this->sorted.begin();
+            typename vector<Entry>::const_iterator b = this->pending.begin();
+            while (a != this->sorted.end() || b != this->pending.end()) {
+                if (b == this->pending.end() || (a != this->sorted.end() && !(*b < *a))) {
+                    if (!a->dead) {
+                        merged.push_back(*a);
+                    }
+                    ++a;
+                } else {
+                    merged.push_back(*b++);
+                }
+            }
+
+            this->sorted.swap(merged);
+            this->pending.clear();
+            this->dead_count = 0;
+            this->dead_tree.clear();
+        }
+
+        void add_dead(size_t idx) {
+            if (this->dead_tree.empty()) {
+                this->dead_tree.assign(this->sorted.size() + 1, 0);
+            }
+            for (size_t i = idx + 1; i < this->dead_tree.size(); i += i & -i) {
+                this->dead_tree[i]++;
+            }
+        }
+
+        // tombstones in sorted[0, end)
+        size_t dead_before(size_t end) const {
+            size_t count = 0;
+            for (size_t i = end; i > 0; i -= i & -i) {
+                count += this->dead_tree[i];
+            }
+            return count;
+        }
+
+        // live entries of cell (x, y) of level, x and y are the top level bits of fixed lon/lat
+        size_t cell_count(uint32_t x, uint32_t y, uint32_t level) const {
+            pair<uint64_t, uint64_t> range = cell_range(x, y, level);
+            size_t begin = lower_bound_code(this->sorted, range.first);
+            size_t end = upper_bound_code(this->sorted, range.second);
+            size_t count = end - begin;
+            count += upper_bound_code(this->pending, range.second) - lower_bound_code(this->pending, range.first);
+            if (this->dead_count != 0) {
+                count -= this->dead_before(end) - this->dead_before(begin);
+            }
+            return count;
+        }
+
+        // inclusive range of codes
+        static pair<uint64_t, uint64_t> cell_range(uint32_t x, uint32_t y, uint32_t level) {
+            if (level == 0) {
+                return make_pair(uint64_t(0), ~uint64_t(0));
+            }
+            uint32_t shift = 32 - level;
+            uint64_t low = GeoFixed::interleave(x << shift, y << shift);
+            uint64_t mask = (uint64_t(1) << (2 * shift)) - 1;
+            return make_pair(low, low | mask);
+        }
+
+        static size_t lower_bound_code(const vector<Entry> &entries, uint64_t code) {
+            size_t lo = 0;
+            size_t hi = entries.size();
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (entries[mid].code < code) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            return lo;
+        }
+
+        static size_t upper_bound_code(const vector<Entry> &entries, uint64_t code) {
+            size_t lo = 0;
+            size_t hi = entries.size();
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (entries[mid].code <= code) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            return lo;
+        }
+
+        void collect_cell(uint32_t x, uint32_t y, uint32_t level, vector<Item> &data) const {
+            pair<uint64_t, uint64_t> range = cell_range(x, y, level);
+            size_t end = upper_bound_code(this->sorted, range.second);
+            for (size_t i = lower_bound_code(this->sorted, range.first); i < end; ++i) {
+                const Entry &e = this->sorted[i];
+                if (!e.dead) {
+                    data.push_back(Item(e.value, e.lon, e.lat));
+                }
+            }
+            end = upper_bound_code(this->pending, range.second);
+            for (size_t i = lower_bound_code(this->pending, range.first); i < end; ++i) {
+                const Entry &e = this->pending[i];
+                data.push_back(Item(e.value, e.lon, e.lat));
+            }
+        }
+
+        vector<Item> nearby_impl(GeoLonLat lonlat, size_t count, uint32_t option) const {
+            vector<Item> ans;
+            if (count == 0 || this->geos.empty()) {
+                return ans;
+            }
+
+            // smallest center cell that covers required count
+            GeoFixed fixed(lonlat);
+            uint32_t fx = fixed.x;
+            uint32_t fy = fixed.y;
+            uint32_t level = 0;
+            while (level < this->max_level) {
+                uint32_t next = level + 1;
+                if (this->cell_count(fx >> (32 - next), fy >> (32 - next), next) < count) {
+                    break;
+                }
+                level = next;
+            }
+
+            // the nine cells around, without wrapping
+            if (level == 0) {
+                this->collect_cell(0, 0, 0, ans);
+            } else {
+                int64_t cx = fx >> (32 - level);
+                int64_t cy = fy >> (32 - level);
+                int64_t last = (int64_t(1) << level) - 1;
+                for (int64_t y = std::max<int64_t>(cy - 1, 0); y <= std::min(cy + 1, last); ++y) {
+                    for (int64_t x = std::max<int64_t>(cx - 1, 0); x <= std::min(cx + 1, last); ++x) {
+                        this->collect_cell(x, y, level, ans);
+                    }
+                }
+            }
+
+            measure_distance(ans, lonlat);
+            if (ans.size() > count) {
+                nth_element(ans.begin(), ans.begin() + count - 1, ans.end());
+                ans.resize(count);
+            }
+            if ((option & GEO_NO_SORT) == 0) {
+                sort(ans.begin(), ans.end());
+            }
+            return ans;
+        }
+
+        static void measure_distance(vector<Item> &data, GeoLonLat lonlat) {
+            vector<float> lons(data.size());
+            vector<float> lats(data.size());
+            vector<uint32_t> dists(data.size());
+            for (size_t i = 0; i < data.size(); ++i) {
+                lons[i] = data[i].lon;
+                lats[i] = data[i].lat;
+            }
+            geo_distance_batch(lonlat.lon, lonlat.lat, lons.data(), lats.data(), data.size(), dists.data());
+            for (size_t i = 0; i < data.size(); ++i) {
+                data[i].dist = dists[i];
+            }
+        }
+
+    // for tests
+#ifdef TWOBLUECUBES_SINGLE_INCLUDE_CATCH_HPP_INCLUDED
+    public:
+        void verify() const {
+            this->size();
+            size_t dead = 0;
+            for (size_t i = 0; i < this->sorted.size(); ++i) {
+                const Entry &e = this->sorted[i];
+                if (i > 0) {
+                    CHECK(this->sorted[i - 1].code <= e.code);
+                }
+                CHECK(e.code == morton_code(GeoLonLat(e.lon, e.lat)));
+                if (e.dead) {
+                    dead++;
+                    continue;
+                }
+                typename MapType::const_iterator it = this->geos.find(e.value);
+                REQUIRE(it != this->geos.end());
+                CHECK(it->second == GeoLonLat(e.lon, e.lat));
+            }
+            CHECK(dead == this->dead_count);
+            CHECK(this->dead_tree.empty() == (dead == 0));
+            for (size_t i = 0; i + 1 < this->dead_tree.size(); ++i) {
+                CHECK(this->dead_before(i + 1) - this->dead_before(i) == this->sorted[i].dead);
+            }
+            for (size_t i = 0; i < this->pending.size(); ++i) {
+                const Entry &e = this->pending[i];
+                if (i > 0) {
+                    CHECK(this->pending[i - 1].code <= e.code);
+                }
+                CHECK(e.code == morton_code(GeoLonLat(e.lon, e.lat)));
+                typename MapType::const_iterator it = this->geos.find(e.value);
+                REQUIRE(it != this->geos.end());
+                CHECK(it->second == GeoLonLat(e.lon, e.lat));
+            }
+        }
+#endif
+    };
+
+}   // namespace geotools
@@ -1,15 +1,30 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cfloat>
+#include <cstdio>
+#include <cstring>
+#include <condition_variable>
+#include <functional>
 #include <stdint.h>
 #include <set>
+#include <string>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <thread>
 #include <math.h>
 #include <utility>
 #include <cassert>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/is_pod.hpp>
 #include <boost/unordered_map.hpp>
 
 #include "geoutil.hpp"
@@ -47,22 +62,313 @@ namespace geotools {
         }
     };
 
+    // attribute bits of leaf points, nothing is stored for trees without attrs
+    template<bool ATTRS>
+    struct GeoAttrArray {
+        vector<uint32_t> bits;
+
+        GeoAttrArray() : bits() {}
+
+        uint32_t operator[](size_t i) const {
+            return this->bits[i];
+        }
+
+        // bits are kept for size points
+        bool fits(size_t size) const {
+            return this->bits.size() == size;
+        }
+
+        void set(size_t i, uint32_t attrs) {
+            this->bits[i] = attrs;
+        }
+
+        void push_back(uint32_t attrs) {
+            this->bits.push_back(attrs);
+        }
+
+        void pop_back() {
+            this->bits.pop_back();
+        }
+
+        void append(const GeoAttrArray &other) {
+            this->bits.insert(this->bits.end(), other.bits.begin(), other.bits.end());
+        }
+
+        void swap(GeoAttrArray &other) {
+            this->bits.swap(other.bits);
+        }
+
+        // clear and release memory
+        void clear() {
+            vector<uint32_t>().swap(this->bits);
+        }
+
+        // union of all bits
+        uint32_t all() const {
+            uint32_t all = 0;
+            for (size_t i = 0; i < this->bits.size(); ++i) {
+                all |= this->bits[i];
+            }
+            return all;
+        }
+    };
+
+    // every point has attrs 0
+    template<>
+    struct GeoAttrArray<false> {
+        uint32_t operator[](size_t) const {
+            return 0;
+        }
+
+        bool fits(size_t) const {
+            return true;
+        }
+
+        void set(size_t, uint32_t attrs) {
+            assert(attrs == 0);
+            (void)attrs;
+        }
+
+        void push_back(uint32_t attrs) {
+            assert(attrs == 0);
+            (void)attrs;
+        }
+
+        void pop_back() {}
+        void append(const GeoAttrArray &) {}
+        void swap(GeoAttrArray &) {}
+        void clear() {}
+
+        uint32_t all() const {
+            return 0;
+        }
+    };
+
+    // union of attribute bits of a subtree
+    template<bool ATTRS>
+    struct GeoAttrUnion {
+        uint32_t bits;
+
+        GeoAttrUnion() : bits(0) {}
+
+        uint32_t get() const {
+            return this->bits;
+        }
+
+        void set(uint32_t attrs) {
+            this->bits = attrs;
+        }
+    };
+
+    template<>
+    struct GeoAttrUnion<false> {
+        uint32_t get() const {
+            return 0;
+        }
+
+        void set(uint32_t attrs) {
+            assert(attrs == 0);
+            (void)attrs;
+        }
+    };
+
+    // flat storage of leaf points: keys and coordinates in parallel arrays,
+    // with unit vectors precomputed for trig free ranking.
+    // attrs of points are kept only if ATTRS is true.
+    template<class T, bool ATTRS = false>
+    struct GeoLeafArray {
+        typedef boost::unordered_map<T, uint32_t> IndexType;
+
+        // leaves are bounded by split_threshold except at max_depth, where piles of close points
+        // may grow without bound. keys of leaves larger than this are found by a hash index.
+        enum { INDEX_SIZE = 256 };
+
+        vector<T> keys;
+        vector<float> lons;
+        vector<float> lats;
+        vector<float> xs;
+        vector<float> ys;
+        vector<float> zs;
+        GeoAttrArray<ATTRS> attrs;  // attribute bits of each point
+        IndexType *index;           // slot of each key, NULL for small leaves
+
+        GeoLeafArray() : keys(), lons(), lats(), xs(), ys(), zs(), attrs(), index(NULL) {}
+
+        GeoLeafArray(const GeoLeafArray &other)
+            : keys(other.keys), lons(other.lons), lats(other.lats),
+            xs(other.xs), ys(other.ys), zs(other.zs), attrs(other.attrs),
+            index(other.index != NULL ? new IndexType(*other.index) : NULL)
+        {}
+
+        GeoLeafArray &operator=(const GeoLeafArray &other) {
+            GeoLeafArray copy(other);
+            this->swap(copy);
+            return *this;
+        }
+
+        ~GeoLeafArray() {
+            delete this->index;
+        }
+
+        size_t size() const {
+            return this->keys.size();
+        }
+
+        // linear scan of small leaves, returns size() if not found
+        size_t find(const T &key) const {
+            if (this->index != NULL) {
+                typename IndexType::const_iterator it = this->index->find(key);
+                return it != this->index->end() ? it->second : this->keys.size();
+            }
+            for (size_t i = 0; i < this->keys.size(); ++i) {
+                if (this->keys[i] == key) {
+                    return i;
+                }
+            }
+            return this->keys.size();
+        }
+
+        // rebuild the index after keys are replaced as a whole
+        void reindex() {
+            delete this->index;
+            this->index = NULL;
+            if (this->size() > INDEX_SIZE) {
+                this->index = new IndexType();
+                this->index->reserve(this->size());
+                for (size_t i = 0; i < this->size(); ++i) {
+                    (*this->index)[this->keys[i]] = i;
+                }
+            }
+        }
+
+        GeoLonLat lonlat(size_t i) const {
+            return GeoLonLat(this->lons[i], this->lats[i]);
+        }
+
+        void push(const T &key, GeoLonLat lonlat, uint32_t attrs) {
+            double x, y, z;
+            geo_to_xyz(lonlat.lon, lonlat.lat, x, y, z);
+            this->keys.push_back(key);
+            this->lons.push_back(lonlat.lon);
+            this->lats.push_back(lonlat.lat);
+            this->xs.push_back(x);
+            this->ys.push_back(y);
+            this->zs.push_back(z);
+            this->attrs.push_back(attrs);
+            if (this->index != NULL) {
+                (*this->index)[key] = this->size() - 1;
+            } else if (this->size() > INDEX_SIZE) {
+                this->reindex();
+            }
+        }
+
+        void set(size_t i, GeoLonLat lonlat) {
+            double x, y, z;
+            geo_to_xyz(lonlat.lon, lonlat.lat, x, y, z);
+            this->lons[i] = lonlat.lon;
+            this->lats[i] = lonlat.lat;
+            this->xs[i] = x;
+            this->ys[i] = y;
+            this->zs[i] = z;
+        }
+
+        // swap with last and pop
+        void remove_at(size_t i) {
+            assert(i < this->size());
+            size_t last = this->size() - 1;
+            if (this->index != NULL) {
+                this->index->erase(this->keys[i]);
+                if (i != last) {
+                    (*this->index)[this->keys[last]] = i;
+                }
+            }
+            if (i != last) {
+                this->keys[i] = this->keys[last];
+                this->lons[i] = this->lons[last];
+                this->lats[i] = this->lats[last];
+                this->xs[i] = this->xs[last];
+                this->ys[i] = this->ys[last];
+                this->zs[i] = this->zs[last];
+                this->attrs.set(i, this->attrs[last]);
+            }
+            this->keys.pop_back();
+            this->lons.pop_back();
+            this->lats.pop_back();
+            this->xs.pop_back();
+            this->ys.pop_back();
+            this->zs.pop_back();
+            this->attrs.pop_back();
+            // dropped well below the limit so that a leaf around it does not rebuild every time
+            if (this->index != NULL && this->size() < INDEX_SIZE / 2) {
+                delete this->index;
+                this->index = NULL;
+            }
+        }
+
+        void append(const GeoLeafArray &other) {
+            this->keys.insert(this->keys.end(), other.keys.begin(), other.keys.end());
+            this->lons.insert(this->lons.end(), other.lons.begin(), other.lons.end());
+            this->lats.insert(this->lats.end(), other.lats.begin(), other.lats.end());
+            this->xs.insert(this->xs.end(), other.xs.begin(), other.xs.end());
+            this->ys.insert(this->ys.end(), other.ys.begin(), other.ys.end());
+            this->zs.insert(this->zs.end(), other.zs.begin(), other.zs.end());
+            this->attrs.append(other.attrs);
+            this->reindex();
+        }
+
+        void swap(GeoLeafArray &other) {
+            this->keys.swap(other.keys);
+            this->lons.swap(other.lons);
+            this->lats.swap(other.lats);
+            this->xs.swap(other.xs);
+            this->ys.swap(other.ys);
+            this->zs.swap(other.zs);
+            this->attrs.swap(other.attrs);
+            std::swap(this->index, other.index);
+        }
+
+        // clear and release memory
+        void clear() {
+            vector<T>().swap(this->keys);
+            vector<float>().swap(this->lons);
+            vector<float>().swap(this->lats);
+            vector<float>().swap(this->xs);
+            vector<float>().swap(this->ys);
+            vector<float>().swap(this->zs);
+            this->attrs.clear();
+            delete this->index;
+            this->index = NULL;
+        }
+    };
+
     // node type
-    enum { GEONODE_LEAF, GEONODE_INNER };
+    enum { GEONODE_LEAF, GEONODE_INNER, GEONODE_FREE };
 
-    template<class T>
+    template<class T, bool ATTRS = false>
     struct GeoNode {
+        enum { HAS_ATTRS = ATTRS };
+
         uint8_t type;
+        GeoAttrUnion<ATTRS> attrs;  // union of attribute bits in this subtree
         uint32_t count;
-        typedef boost::unordered_map<T, GeoLonLat> MapType;
-        MapType values;     // TODO: try skip list here
+        mutable std::atomic<uint32_t> refs;     // parents and snapshots sharing this node, see GeoTree::own
+        typedef GeoLeafArray<T, ATTRS> LeafType;
+        LeafType values;
 
         GeoNode *NW;
         GeoNode *NE;
         GeoNode *SE;
         GeoNode *SW;
 
-        GeoNode(uint8_t type) : type(type), count(0), NW(NULL), NE(NULL), SE(NULL), SW(NULL) {}
+        GeoNode(uint8_t type)
+            : type(type), attrs(), count(0), refs(1), NW(NULL), NE(NULL), SE(NULL), SW(NULL)
+        {}
+
+        // an unshared copy, children are not copied
+        GeoNode(const GeoNode &other)
+            : type(other.type), attrs(other.attrs), count(other.count), refs(1), values(other.values),
+            NW(other.NW), NE(other.NE), SE(other.SE), SW(other.SW)
+        {}
 
         void destroy() {
             if (NW) NW->destroy();
@@ -82,30 +388,48 @@ namespace geotools {
             return this->type == GEONODE_LEAF;
         }
 
-        bool add(const T &value, GeoLonLat lonlat) {
+        bool add(const T &value, GeoLonLat lonlat, uint32_t attrs = 0) {
             assert(this->is_leaf());
-            pair<typename MapType::iterator, bool> itok = this->values.insert(make_pair(value, lonlat));
-            if (itok.second) {
-                this->count++;
+            if (this->values.find(value) != this->values.size()) {
+                return false;
             }
+            this->must_add(value, lonlat, attrs);
+            return true;
+        }
+
+        // caller guarantees that value is not in this leaf
+        void must_add(const T &value, GeoLonLat lonlat, uint32_t attrs = 0) {
+            assert(this->is_leaf());
+            assert(this->values.find(value) == this->values.size());
+            this->values.push(value, lonlat, attrs);
+            this->count++;
+            this->attrs.set(this->attrs.get() | attrs);
             assert(this->count == this->values.size());
-            return itok.second;
         }
 
-        void must_remove(const T &value) {
+        // returns attribute bits of the removed value
+        uint32_t must_remove(const T &value) {
             assert(this->is_leaf());
-            size_t removed = this->values.erase(value);
-            assert(removed == 1);
+            size_t idx = this->values.find(value);
+            assert(idx != this->values.size());
+            uint32_t removed = this->values.attrs[idx];
+            this->values.remove_at(idx);
             this->count--;
+            if (removed != 0) {
+                this->attrs.set(this->values.attrs.all());
+            }
             assert(this->count == this->values.size());
+            return removed;
         }
 
+        // count and attribute union of children
         void update_count() {
             assert(!this->is_leaf());
             this->count = count_of(this->NW) + count_of(this->NE) + count_of(this->SE) + count_of(this->SW);
+            this->attrs.set(attrs_of(this->NW) | attrs_of(this->NE) | attrs_of(this->SE) | attrs_of(this->SW));
         }
 
-        GeoNode<T> *&get(int dir) {
+        GeoNode *&get(int dir) {
             switch (dir) {
             case D_NW: return this->NW;
             case D_NE: return this->NE;
@@ -116,7 +440,7 @@ namespace geotools {
             }
         }
 
-        const GeoNode<T> *get(int dir) const {
+        const GeoNode *get(int dir) const {
             switch (dir) {
             case D_NW: return this->NW;
             case D_NE: return this->NE;
@@ -127,9 +451,95 @@ namespace geotools {
             }
         }
 
-        static uint32_t count_of(const GeoNode<T> *node) {
+        static uint32_t count_of(const GeoNode *node) {
             return node != NULL ? node->count : 0;
         }
+
+        static uint32_t attrs_of(const GeoNode *node) {
+            return node != NULL ? node->attrs.get() : 0;
+        }
+    };
+
+    // node allocator that news and deletes each node
+    template<class T, bool ATTRS = false>
+    struct GeoNodeHeapAlloc {
+        typedef GeoNode<T, ATTRS> Node;
+
+        Node *alloc(uint8_t type) {
+            return new Node(type);
+        }
+
+        void free(Node *node) {
+            delete node;
+        }
+
+        // free the whole tree
+        void clear(Node *root) {
+            if (root != NULL) {
+                root->destroy();
+            }
+        }
+    };
+
+    // node allocator with slabs of contiguous nodes and a free list of recycled nodes.
+    // clear() walks the slabs linearly instead of the tree.
+    template<class T, bool ATTRS = false, size_t SLAB_SIZE = 256>
+    class GeoNodePool {
+    public:
+        typedef GeoNode<T, ATTRS> Node;
+
+        GeoNodePool() : slabs(), used(SLAB_SIZE), free_list(NULL) {}
+
+        ~GeoNodePool() {
+            this->clear(NULL);
+        }
+
+        Node *alloc(uint8_t type) {
+            Node *node = this->free_list;
+            if (node != NULL) {
+                this->free_list = node->NW;
+                node->~Node();
+            } else {
+                if (this->used == SLAB_SIZE) {
+                    this->slabs.push_back(static_cast<Node *>(::operator new(sizeof(Node) * SLAB_SIZE)));
+                    this->used = 0;
+                }
+                node = this->slabs.back() + this->used++;
+            }
+            return new (node) Node(type);
+        }
+
+        void free(Node *node) {
+            // keep slots constructed, free ones are marked and linked by NW
+            node->~Node();
+            new (node) Node(GEONODE_FREE);
+            node->NW = this->free_list;
+            this->free_list = node;
+        }
+
+        // free all nodes, root is ignored
+        void clear(Node *root) {
+            (void)root;
+            for (size_t i = 0; i < this->slabs.size(); ++i) {
+                size_t size = i + 1 == this->slabs.size() ? this->used : SLAB_SIZE;
+                for (size_t j = 0; j < size; ++j) {
+                    this->slabs[i][j].~Node();
+                }
+                ::operator delete(this->slabs[i]);
+            }
+            this->slabs.clear();
+            this->used = SLAB_SIZE;
+            this->free_list = NULL;
+        }
+
+    private:
+        // not copyable
+        GeoNodePool(const GeoNodePool &);
+        GeoNodePool &operator=(const GeoNodePool &);
+
+        vector<Node *> slabs;
+        size_t used;        // of the last slab
+        Node *free_list;
     };
 
     struct GeoBox {
@@ -142,6 +552,45 @@ namespace geotools {
             return W <= lonlat.lon && lonlat.lon <= E && S <= lonlat.lat && lonlat.lat <= N;
         }
 
+        bool contains(const GeoBox &box) const {
+            return W <= box.W && box.E <= E && S <= box.S && box.N <= N;
+        }
+
+        bool intersects(const GeoBox &box) const {
+            return W <= box.E && box.W <= E && S <= box.N && box.S <= N;
+        }
+
+        // lower bound of distance in meters from lonlat to any point of this box
+        double min_distance(GeoLonLat lonlat) const {
+            if (W <= lonlat.lon && lonlat.lon <= E) {
+                if (lonlat.lat > N) {
+                    return deg2rad(lonlat.lat - N) * EARTH_RADIUS_IN_METERS;
+                } else if (lonlat.lat < S) {
+                    return deg2rad(S - lonlat.lat) * EARTH_RADIUS_IN_METERS;
+                } else {
+                    return 0;
+                }
+            }
+
+            // the nearest point lies on the west or east edge
+            return std::min(
+                geo_distance_to_meridian(lonlat.lon, lonlat.lat, W, S, N),
+                geo_distance_to_meridian(lonlat.lon, lonlat.lat, E, S, N));
+        }
+
+        // upper bound of distance in meters from lonlat to any point of this box
+        double max_distance(GeoLonLat lonlat) const {
+            // the farthest point is the nearest one to the antipode
+            GeoLonLat anti(lonlat.lon < 0 ? lonlat.lon + 180 : lonlat.lon - 180, -lonlat.lat);
+            return M_PI * EARTH_RADIUS_IN_METERS - this->min_distance(anti);
+        }
+
+        // surface in square meters
+        double area() const {
+            return EARTH_RADIUS_IN_METERS * EARTH_RADIUS_IN_METERS
+                * deg2rad(E - W) * (sin(deg2rad(N)) - sin(deg2rad(S)));
+        }
+
         GeoBox get(int dir) const {
             switch (dir) {
             case D_NW: return GeoBox(W, (W + E) / 2.0, N, (N + S) / 2.0);
@@ -203,140 +652,762 @@ namespace geotools {
     };
 
 
+    // lon/lat as 32 bit fixed point, x and y count 2^-32 of the lon and lat range. the quadtree
+    // cell of depth d is the top d bits of x and y, so a descent needs no float midpoints.
+    // conversion rounds down to the cell boundary exactly, edges min + span * x / 2^32 are
+    // exact in double, and agrees with GeoBox::locate_and_move while its float boxes are exact
+    // (depth 17 and less).
+    struct GeoFixed {
+        uint32_t x;
+        uint32_t y;
+
+        GeoFixed(uint32_t x, uint32_t y) : x(x), y(y) {}
+
+        explicit GeoFixed(GeoLonLat lonlat)
+            : x(to_fixed(lonlat.lon, LON_MIN, LON_MAX)), y(to_fixed(lonlat.lat, LAT_MIN, LAT_MAX))
+        {}
+
+        // direction of the child at depth containing this, same as GeoBox::locate
+        int dir(uint32_t depth) const {
+            assert(depth < 32);
+            uint32_t east = (this->x >> (31 - depth)) & 1;
+            uint32_t north = (this->y >> (31 - depth)) & 1;
+            return (D_W << east) | (D_S >> north);
+        }
+
+        // depth of the smallest cell containing both
+        uint32_t common_depth(const GeoFixed &other) const {
+            uint32_t diff = (this->x ^ other.x) | (this->y ^ other.y);
+            return diff == 0 ? 32 : __builtin_clz(diff);
+        }
+
+        // cell of depth containing this
+        GeoBox box(uint32_t depth) const {
+            assert(depth <= 32);
+            uint64_t size = uint64_t(1) << (32 - depth);
+            uint64_t x0 = this->x & ~(size - 1);
+            uint64_t y0 = this->y & ~(size - 1);
+            return GeoBox(
+                from_fixed(x0, LON_MIN, LON_MAX), from_fixed(x0 + size, LON_MIN, LON_MAX),
+                from_fixed(y0 + size, LAT_MIN, LAT_MAX), from_fixed(y0, LAT_MIN, LAT_MAX));
+        }
+
+        // lat bits are the higher of each pair
+        uint64_t morton() const {
+            return interleave(this->x, this->y);
+        }
+
+        static uint64_t interleave(uint32_t x, uint32_t y) {
+            return spread(x) | (spread(y) << 1);
+        }
+
+        static uint64_t spread(uint32_t v) {
+            uint64_t x = v;
+            x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+            x = (x | (x << 8))  & 0x00FF00FF00FF00FFULL;
+            x = (x | (x << 4))  & 0x0F0F0F0F0F0F0F0FULL;
+            x = (x | (x << 2))  & 0x3333333333333333ULL;
+            x = (x | (x << 1))  & 0x5555555555555555ULL;
+            return x;
+        }
+
+        static double from_fixed(uint64_t x, float min, float max) {
+            return min + ((double)max - min) * x / 4294967296.0;
+        }
+
+        // largest x with from_fixed(x) <= value. the scaled value is off by at most one
+        static uint32_t to_fixed(float value, float min, float max) {
+            double scaled = ((double)value - min) / ((double)max - min) * 4294967296.0;
+            uint32_t x = scaled <= 0 ? 0 : scaled >= 4294967295.0 ? 0xFFFFFFFFu : uint32_t(scaled);
+            if (from_fixed(x, min, max) > value) {
+                x--;
+            } else if (x != 0xFFFFFFFFu && from_fixed(x + 1, min, max) <= value) {
+                x++;
+            }
+            return x;
+        }
+    };
+
+
     enum GeoOption {
         GEO_OPT_NONE = 0,
         GEO_NO_SORT = 1 << 0,
+        GEO_NO_DIST = 1 << 1,   // leave Item::dist as 0, implies GEO_NO_SORT
     };
 
 
+    // query result, dist in meters
     template<class T>
-    class GeoTree {
-    private:
-        typedef GeoNode<T> Node;
-        typedef Node *NodePtr;
+    struct GeoItem {
+        T value;
+        float lon;
+        float lat;
+        uint32_t dist;
 
-        GeoNode<T> *root;
-        typedef boost::unordered_map<T, GeoLonLat> MapType;
-        MapType geos;
-        uint32_t split_threshold;
-        uint32_t max_depth;     // TODO: setter and getter
+        GeoItem(const T &value, float lon, float lat)
+            : value(value), lon(lon), lat(lat), dist(0)
+        {}
 
-        static size_t node_size(const GeoNode<T> *node) {
-            return node != NULL ? node->count : 0;
+        GeoItem()
+            : value(), lon(FLT_MAX), lat(FLT_MAX), dist(~uint32_t(0))
+        {}
+
+        bool operator<(const GeoItem &rhs) const {
+            return this->dist < rhs.dist;
         }
 
-        struct GeoInsertCtx {
-            T value;
-            GeoLonLat lonlat;
-            GeoBox box;
-            uint32_t depth;
+        bool operator==(const GeoItem &rhs) const {
+            return value == rhs.value
+                && lon == rhs.lon && lat == rhs.lat && dist == rhs.dist;
+        }
+    };
 
-            GeoInsertCtx(const T &value, GeoLonLat lonlat)
-                : value(value), lonlat(lonlat), box(), depth(0)
-            {}
-        };
+    // view of items owned by someone else
+    template<class T>
+    struct GeoItemRange {
+        typedef const GeoItem<T> *const_iterator;
 
-    public:
-        GeoTree(uint32_t split_threshold = 128)
-            : root(NULL), geos(), split_threshold(split_threshold), max_depth(16)   // less than 1km
-        {}
+        const GeoItem<T> *first;
+        const GeoItem<T> *last;
 
-        ~GeoTree() {
-            if (this->root != NULL) {
-                this->root->destroy();
-            }
+        GeoItemRange(const GeoItem<T> *first, const GeoItem<T> *last) : first(first), last(last) {}
+
+        const_iterator begin() const {
+            return this->first;
         }
 
-        // TODO: copy constructor
+        const_iterator end() const {
+            return this->last;
+        }
 
-        struct Item {
-            T value;
-            float lon;
-            float lat;
-            uint32_t dist;
+        size_t size() const {
+            return this->last - this->first;
+        }
 
-            Item(const T &value, float lon, float lat)
-                : value(value), lon(lon), lat(lat), dist(0)
-            {}
+        bool empty() const {
+            return this->first == this->last;
+        }
 
-            Item()
-                : value(), lon(FLT_MAX), lat(FLT_MAX), dist(~uint32_t(0))
-            {}
+        const GeoItem<T> &operator[](size_t i) const {
+            return this->first[i];
+        }
+    };
 
-            bool operator<(const Item &rhs) const {
-                return this->dist < rhs.dist;
-            }
+    // 64 bit FNV-1a over 8 byte words, then the tail bytes
+    inline uint64_t geo_checksum(const char *data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+        const uint64_t prime = 1099511628211ULL;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            hash = (hash ^ word) * prime;
+        }
+        for (; i < size; ++i) {
+            hash = (hash ^ (uint8_t)data[i]) * prime;
+        }
+        return hash;
+    }
 
-            bool operator==(const Item &rhs) const {
-                return value == rhs.value
-                    && lon == rhs.lon && lat == rhs.lat && dist == rhs.dist;
-            }
-        };
+    // native byte order, no alignment
+    struct GeoByteWriter {
+        vector<char> buf;
 
-        size_t size() const {
-            assert(this->geos.size() == node_size(this->root));
-            return this->geos.size();
+        template<class V>
+        void put(const V &value) {
+            this->put_array(&value, 1);
         }
 
-        static bool is_valid(float lon, float lat) {
-            return GeoLonLat(lon, lat).is_valid();
+        template<class V>
+        void put_array(const V *values, size_t size) {
+            const char *bytes = reinterpret_cast<const char *>(values);
+            this->buf.insert(this->buf.end(), bytes, bytes + sizeof(V) * size);
         }
+    };
 
-        bool insert(const T &value, float lon, float lat) {
-            assert(is_valid(lon, lat));
-
-            GeoInsertCtx ctx(value, GeoLonLat(lon, lat));
+    // reads fail instead of running past end
+    struct GeoByteReader {
+        const char *pos;
+        const char *end;
 
-            typename MapType::iterator it = this->geos.find(value);
-            bool exists = it != this->geos.end();
-            if (exists) {
-                GeoInsertCtx rem_ctx(value, it->second);
-                this->root = this->remove_rec(rem_ctx, this->root);
-                it->second = ctx.lonlat;
-            } else {
-                this->geos.insert(make_pair(value, ctx.lonlat));
-            }
+        GeoByteReader(const char *pos, const char *end) : pos(pos), end(end) {}
 
-            this->root = this->insert_rec(ctx, this->root);
-            return !exists;
+        template<class V>
+        bool get(V &value) {
+            return this->get_array(&value, 1);
         }
 
-        bool insert(const Item &item) {
-            return insert(item.value, item.lon, item.lat);
+        template<class V>
+        bool get_array(V *values, size_t size) {
+            if (size > (size_t)(this->end - this->pos) / sizeof(V)) {
+                return false;
+            }
+            memcpy(values, this->pos, sizeof(V) * size);
+            this->pos += sizeof(V) * size;
+            return true;
         }
 
-        bool erase(const T &value) {
-            typename MapType::iterator it = this->geos.find(value);
-            if (it == this->geos.end()) {
+        template<class V>
+        bool get_vector(vector<V> &values, size_t size) {
+            if (size > (size_t)(this->end - this->pos) / sizeof(V)) {
                 return false;
             }
+            values.resize(size);
+            return this->get_array(values.data(), size);
+        }
+    };
 
-            GeoInsertCtx ctx(value, it->second);
-            this->root = this->remove_rec(ctx, this->root);
-            this->geos.erase(it);
-            return true;
+    // whole file into buf, false on io error
+    inline bool geo_read_file(const char *path, vector<char> &buf) {
+        FILE *fp = fopen(path, "rb");
+        if (fp == NULL) {
+            return false;
+        }
+        bool ok = fseek(fp, 0, SEEK_END) == 0;
+        long size = ok ? ftell(fp) : -1;
+        ok = size >= 0 && fseek(fp, 0, SEEK_SET) == 0;
+        if (ok) {
+            buf.resize(size);
+            ok = fread(buf.data(), 1, size, fp) == (size_t)size;
+        }
+        fclose(fp);
+        return ok;
+    }
+
+    // fsync the directory holding path, so that a rename or unlink in it is durable
+    inline bool geo_sync_dir(const char *path) {
+        string dir(path);
+        size_t slash = dir.rfind('/');
+        dir = slash == string::npos ? "." : slash == 0 ? "/" : dir.substr(0, slash);
+        int fd = ::open(dir.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
         }
+        bool ok = fsync(fd) == 0;
+        ::close(fd);
+        return ok;
+    }
+
+    // write to path.tmp, fsync it and rename over path, then fsync the directory.
+    // an existing file is never left half written, even on power loss.
+    inline bool geo_write_file(const char *path, const vector<char> &buf) {
+        string tmp = string(path) + ".tmp";
+        FILE *fp = fopen(tmp.c_str(), "wb");
+        if (fp == NULL) {
+            return false;
+        }
+        bool ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+        ok = fflush(fp) == 0 && ok;
+        // the rename may otherwise reach the disk before the data
+        ok = ok && fsync(fileno(fp)) == 0;
+        ok = fclose(fp) == 0 && ok;
+        ok = ok && rename(tmp.c_str(), path) == 0;
+        if (!ok) {
+            remove(tmp.c_str());
+            return false;
+        }
+        return geo_sync_dir(path);
+    }
 
-        vector<Item> get_nearby(
-            float lon, float lat, size_t count, uint32_t option = GEO_OPT_NONE) const
+    // threads kept for running parts of query batches, so that a batch starts none.
+    // run is called from one thread at a time.
+    class GeoWorkerPool {
+    public:
+        explicit GeoWorkerPool(size_t threads)
+            : workers(), mutex(), wakeup(), done(), task(), tasks(0), next(0), finished(0), round(0), stopping(false)
         {
-            return nearby_impl(GeoLonLat(lon, lat), count, option);
+            assert(threads > 0);
+            for (size_t i = 0; i < threads; ++i) {
+                this->workers.push_back(std::thread(&GeoWorkerPool::work_loop, this));
+            }
         }
 
-        // TODO: optimize
-        uint32_t get_nearby_radius_by_count(float lon, float lat, size_t count) const {
-            vector<Item> items = get_nearby(lon, lat, count);
-            if (items.empty()) {
-                return 0;
-            } else {
-                return items.back().dist;
+        ~GeoWorkerPool() {
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->stopping = true;
+            }
+            this->wakeup.notify_all();
+            for (size_t i = 0; i < this->workers.size(); ++i) {
+                this->workers[i].join();
+            }
+        }
+
+        size_t size() const {
+            return this->workers.size();
+        }
+
+        // task(i) for i in [0, tasks) on the workers, returns when all are done
+        void run(size_t tasks, const std::function<void(size_t)> &task) {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->task = task;
+            this->tasks = tasks;
+            this->next = 0;
+            this->finished = 0;
+            this->round++;
+            this->wakeup.notify_all();
+            while (this->finished < this->tasks) {
+                this->done.wait(lock);
             }
+            this->task = nullptr;
         }
 
     private:
-        struct NineBox {
-            typedef const Node *ConstNodePtr;
-            ConstNodePtr NW, N, NE, W, C, E, SW, S, SE;
+        GeoWorkerPool(const GeoWorkerPool &);
+        GeoWorkerPool &operator=(const GeoWorkerPool &);
+
+        void work_loop() {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            uint64_t seen = 0;
+            while (true) {
+                while (this->round == seen && !this->stopping) {
+                    this->wakeup.wait(lock);
+                }
+                if (this->stopping) {
+                    return;
+                }
+                seen = this->round;
+                while (this->next < this->tasks) {
+                    size_t i = this->next++;
+                    lock.unlock();
+                    this->task(i);
+                    lock.lock();
+                    if (++this->finished == this->tasks) {
+                        this->done.notify_all();
+                    }
+                }
+            }
+        }
+
+        vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        std::condition_variable done;
+        // all below are guarded by mutex, task is not changed while tasks are left
+        std::function<void(size_t)> task;
+        size_t tasks;
+        size_t next;
+        size_t finished;
+        uint64_t round;
+        bool stopping;
+    };
+
+    template<class T, class Alloc>
+    class ConcurrentGeoTree;
+
+    template<class T>
+    class GeoFrozenTree;
+
+    // nodes come from Alloc, which also tells whether points have attrs. only a tree of
+    // GeoNodePool<T, true> or GeoNodeHeapAlloc<T, true> keeps them, at 4 bytes per point,
+    // and has the attrs API: insert with attrs, set_attrs and the *_by_attrs queries.
+    template<class T, class Alloc = GeoNodePool<T> >
+    class GeoTree {
+    private:
+        // runs the query algorithms on its own published roots
+        template<class U, class A>
+        friend class ConcurrentGeoTree;
+        // freezes the nodes and shares the query helpers
+        template<class U>
+        friend class GeoFrozenTree;
+
+        typedef typename Alloc::Node Node;
+        typedef Node *NodePtr;
+
+        Alloc alloc;
+        Node *root;
+        typedef boost::unordered_map<T, GeoLonLat> MapType;
+        MapType geos;
+        uint32_t split_threshold;
+        uint32_t merge_threshold;   // inner node is merged into a leaf when count <= this
+        uint32_t max_depth;     // TODO: setter and getter
+
+        // live snapshots, and roots of destroyed ones left for the writer to free
+        std::atomic<size_t> snapshots;
+        std::mutex orphan_mutex;
+        vector<Node *> orphans;
+        std::atomic<bool> has_orphans;
+
+        // copy with snapshot()
+        GeoTree(const GeoTree &);
+        GeoTree &operator=(const GeoTree &);
+
+        static size_t node_size(const Node *node) {
+            return node != NULL ? node->count : 0;
+        }
+
+        struct GeoInsertCtx {
+            T value;
+            GeoLonLat lonlat;
+            uint32_t attrs;     // attribute bits to insert, or of the removed value
+            GeoFixed fixed;     // of lonlat, gives the path from the root
+            uint32_t depth;     // of the current node
+
+            GeoInsertCtx(const T &value, GeoLonLat lonlat, uint32_t attrs = 0)
+                : value(value), lonlat(lonlat), attrs(attrs), fixed(lonlat), depth(0)
+            {}
+
+            // child direction of the current node, which becomes the child
+            int locate_and_move() {
+                return this->fixed.dir(this->depth++);
+            }
+        };
+
+        enum {
+            FILE_MAGIC = 0x47545245,    // "GTRE", also tells byte order
+            FILE_VERSION = 1,
+        };
+
+        // followed by nodes in pre-order and the checksum of all bytes before it
+        struct GeoFileHeader {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t key_size;
+            uint32_t split_threshold;
+            uint32_t merge_threshold;
+            uint32_t max_depth;
+            uint64_t items;
+            uint64_t body_size;     // bytes of nodes
+        };
+
+    public:
+        GeoTree(uint32_t split_threshold = 128)
+            : alloc(), root(NULL), geos(), split_threshold(split_threshold),
+            merge_threshold(split_threshold / 2), max_depth(16),   // less than 1km
+            snapshots(0), orphan_mutex(), orphans(), has_orphans(false)
+        {}
+
+        // all snapshots must have been destroyed
+        ~GeoTree() {
+            assert(this->snapshots.load() == 0);
+            this->reclaim();
+            this->alloc.clear(this->root);
+        }
+
+        typedef GeoItem<T> Item;
+        typedef GeoItemRange<T> ItemRange;
+
+        // reusable buffers of nearby queries, not shared between threads.
+        // queries with a scratch allocate nothing once its buffers have grown to the largest query.
+        struct NearbyScratch {
+            vector<const Node *> leaves;
+            vector<float> proxies;
+            vector<float> selected;     // nth_element of proxies
+            vector<Item> ans;
+            vector<Item> tied;
+            vector<float> lons;
+            vector<float> lats;
+            vector<uint32_t> dists;
+        };
+
+        // must be less than split threshold to avoid split/merge thrashing, 0 disables merging
+        void set_merge_threshold(uint32_t merge_threshold) {
+            assert(merge_threshold < this->split_threshold);
+            this->merge_threshold = merge_threshold;
+        }
+
+        uint32_t get_merge_threshold() const {
+            return this->merge_threshold;
+        }
+
+        size_t size() const {
+            assert(this->geos.size() == node_size(this->root));
+            return this->geos.size();
+        }
+
+        static bool is_valid(float lon, float lat) {
+            return GeoLonLat(lon, lat).is_valid();
+        }
+
+        // a new value has attrs 0, an existing one is moved and keeps its attrs
+        bool insert(const T &value, float lon, float lat) {
+            return this->insert_impl(value, GeoLonLat(lon, lat), NULL);
+        }
+
+        // attrs are bits the filtered queries test with a mask, replaced on an existing value
+        bool insert(const T &value, float lon, float lat, uint32_t attrs) {
+            BOOST_STATIC_ASSERT_MSG(Node::HAS_ATTRS, "tree keeps no attrs");
+            return this->insert_impl(value, GeoLonLat(lon, lat), &attrs);
+        }
+
+        // update position of an existing value and keep its attrs, returns false if value not exists
+        bool move(const T &value, float lon, float lat) {
+            assert(is_valid(lon, lat));
+            this->reclaim();
+
+            typename MapType::iterator it = this->geos.find(value);
+            if (it == this->geos.end()) {
+                return false;
+            }
+            this->move_existing(it, GeoLonLat(lon, lat));
+            return true;
+        }
+
+        bool insert(const Item &item) {
+            return insert(item.value, item.lon, item.lat);
+        }
+
+        // returns false if value not exists
+        bool set_attrs(const T &value, uint32_t attrs) {
+            BOOST_STATIC_ASSERT_MSG(Node::HAS_ATTRS, "tree keeps no attrs");
+            typename MapType::const_iterator it = this->geos.find(value);
+            if (it == this->geos.end()) {
+                return false;
+            }
+            this->reclaim();
+            GeoInsertCtx ctx(value, it->second, attrs);
+            this->root = this->set_attrs_rec(ctx, this->root);
+            return true;
+        }
+
+        void clear() {
+            // read before reclaim: a snapshot destroyed between them would leave its root on
+            // orphans while alloc.clear frees it. with no snapshot left, reclaim empties orphans for good.
+            bool shared = this->snapshots.load() != 0;
+            this->reclaim();
+            if (!shared) {
+                this->alloc.clear(this->root);
+            } else {
+                this->release(this->root);
+            }
+            this->root = NULL;
+            this->geos.clear();
+        }
+
+        // replace content with items of [first, last), later items win on duplicated values.
+        // attrs of all items are 0. points are sorted in quadtree order and nodes are built bottom-up without splits.
+        template<class Iter>
+        void bulk_load(Iter first, Iter last) {
+            this->clear();
+            this->geos.reserve(std::distance(first, last));
+            for (; first != last; ++first) {
+                const Item &item = *first;
+                assert(is_valid(item.lon, item.lat));
+                pair<typename MapType::iterator, bool> itok
+                    = this->geos.insert(make_pair(item.value, GeoLonLat(item.lon, item.lat)));
+                if (!itok.second) {
+                    itok.first->second = GeoLonLat(item.lon, item.lat);
+                }
+            }
+
+            vector<BulkEntry> entries;
+            entries.reserve(this->geos.size());
+            for (typename MapType::const_iterator it = this->geos.begin(); it != this->geos.end(); ++it) {
+                entries.push_back(BulkEntry(this->quad_code(it->second), &*it));
+            }
+            sort(entries.begin(), entries.end());
+
+            if (!entries.empty()) {
+                this->root = this->bulk_build(entries.data(), entries.data() + entries.size(), 0);
+            }
+        }
+
+        // binary snapshot of the node structure for load, T must be POD. false on io error.
+        // the file is written next to path, synced and renamed over it.
+        bool save(const char *path) const {
+            GeoFileHeader header = {
+                FILE_MAGIC, FILE_VERSION, sizeof(T),
+                this->split_threshold, this->merge_threshold, this->max_depth,
+                this->geos.size(), 0,
+            };
+            return save_impl(this->root, header, path);
+        }
+
+        // replace content and thresholds with a file of save, nodes are read back as they were
+        // without any insert or split. a file of other version or key size, truncated or failing
+        // its checksum is rejected before the tree is touched, false is returned.
+        // a tree without attrs takes files of trees with attrs only if all of them are 0.
+        bool load(const char *path) {
+            BOOST_STATIC_ASSERT(boost::is_pod<T>::value);
+            vector<char> buf;
+            if (!geo_read_file(path, buf)) {
+                return false;
+            }
+
+            GeoFileHeader header;
+            uint64_t sum;
+            GeoByteReader reader(buf.data(), buf.data() + buf.size());
+            if (!reader.get(header) || header.magic != FILE_MAGIC || header.version != FILE_VERSION
+                || header.key_size != sizeof(T)
+                || header.body_size + sizeof(sum) != (uint64_t)(reader.end - reader.pos))
+            {
+                return false;
+            }
+            reader.end -= sizeof(sum);
+            memcpy(&sum, reader.end, sizeof(sum));
+            if (geo_checksum(buf.data(), buf.size() - sizeof(sum)) != sum) {
+                return false;
+            }
+
+            this->clear();
+            this->split_threshold = header.split_threshold;
+            this->merge_threshold = header.merge_threshold;
+            this->max_depth = header.max_depth;
+            this->geos.reserve(header.items);
+            bool ok = header.items == 0 || this->load_node(reader, this->root, 0);
+            if (!ok || reader.pos != reader.end || this->geos.size() != header.items
+                || node_size(this->root) != header.items)
+            {
+                this->clear();
+                return false;
+            }
+            return true;
+        }
+
+        bool erase(const T &value) {
+            typename MapType::iterator it = this->geos.find(value);
+            if (it == this->geos.end()) {
+                return false;
+            }
+            this->reclaim();
+
+            GeoInsertCtx ctx(value, it->second);
+            this->root = this->remove_rec(ctx, this->root);
+            this->geos.erase(it);
+            return true;
+        }
+
+        vector<Item> get_nearby(
+            float lon, float lat, size_t count, uint32_t option = GEO_OPT_NONE) const
+        {
+            return nearby_impl(this->root, GeoLonLat(lon, lat), count, option);
+        }
+
+        // same as get_nearby, results are kept in scratch and valid until its next use
+        ItemRange get_nearby(
+            float lon, float lat, size_t count, NearbyScratch &scratch, uint32_t option = GEO_OPT_NONE) const
+        {
+            nearby_into(this->root, GeoLonLat(lon, lat), count, option, scratch);
+            return ItemRange(scratch.ans.data(), scratch.ans.data() + scratch.ans.size());
+        }
+
+        // get_nearby of many points at once, results of points[i] are written to
+        // out[i * count, i * count + sizes[i]). queries are run in quadtree order so that
+        // neighbouring ones share the descent and the leaves of the same nine box.
+        // with a pool the batch is split into a part for each of its threads.
+        void get_nearby_batch(
+            const GeoLonLat *points, size_t size, size_t count, Item *out, size_t *sizes,
+            uint32_t option = GEO_OPT_NONE, GeoWorkerPool *pool = NULL) const
+        {
+            if (count == 0 || this->root == NULL) {
+                fill(sizes, sizes + size, 0);
+                return;
+            }
+
+            vector<BatchEntry> order(size);
+            for (size_t i = 0; i < size; ++i) {
+                order[i] = BatchEntry(this->quad_code(points[i]), i);
+            }
+            sort(order.begin(), order.end());
+
+            const BatchEntry *begin = order.data();
+            size_t parts = pool != NULL ? std::min(pool->size(), size) : 1;
+            if (parts <= 1) {
+                this->nearby_batch_range(begin, begin + size, points, count, option, out, sizes);
+                return;
+            }
+
+            // contiguous ranges keep neighbouring queries together
+            size_t chunk = (size + parts - 1) / parts;
+            pool->run((size + chunk - 1) / chunk, [&](size_t i) {
+                size_t lo = i * chunk;
+                size_t hi = std::min(size, lo + chunk);
+                this->nearby_batch_range(begin + lo, begin + hi, points, count, option, out, sizes);
+            });
+        }
+
+        // exact k nearest neighbours by best-first traversal
+        vector<Item> get_nearest(
+            float lon, float lat, size_t count, uint32_t option = GEO_OPT_NONE) const
+        {
+            return nearest_impl(this->root, GeoLonLat(lon, lat), count, option);
+        }
+
+        // nearest count items with pred(value) true, like get_nearest. pred is called
+        // before distances are measured, and the search expands until count items match.
+        template<class Pred>
+        vector<Item> get_nearby_if(
+            float lon, float lat, size_t count, Pred pred, uint32_t option = GEO_OPT_NONE) const
+        {
+            return nearest_if_impl(this->root, GeoLonLat(lon, lat), count, option, pred);
+        }
+
+        // nearest count items having all bits of mask in their attrs,
+        // subtrees without them are skipped by the attribute union of nodes
+        vector<Item> get_nearest_by_attrs(
+            float lon, float lat, size_t count, uint32_t mask, uint32_t option = GEO_OPT_NONE) const
+        {
+            BOOST_STATIC_ASSERT_MSG(Node::HAS_ATTRS, "tree keeps no attrs");
+            AttrMask pred(mask);
+            return nearest_if_impl(this->root, GeoLonLat(lon, lat), count, option, pred);
+        }
+
+        class NearestIterator;
+
+        // lazy version of get_nearest for consumers that stop early, the tree must not be
+        // modified while iterating
+        NearestIterator iter_nearest(float lon, float lat) const {
+            return NearestIterator(this->root, GeoLonLat(lon, lat));
+        }
+
+        // all items within meters, at most limit items (not necessarily the nearest) if limit != 0
+        vector<Item> get_within_radius(
+            float lon, float lat, uint32_t meters,
+            uint32_t option = GEO_OPT_NONE, size_t limit = 0) const
+        {
+            return radius_impl(this->root, GeoLonLat(lon, lat), meters, option, limit);
+        }
+
+        // get_within_radius of items having all bits of mask in their attrs
+        vector<Item> get_within_radius_by_attrs(
+            float lon, float lat, uint32_t meters, uint32_t mask,
+            uint32_t option = GEO_OPT_NONE, size_t limit = 0) const
+        {
+            BOOST_STATIC_ASSERT_MSG(Node::HAS_ATTRS, "tree keeps no attrs");
+            return radius_impl(this->root, GeoLonLat(lon, lat), meters, option, limit, mask);
+        }
+
+        // number of items inside box, whole subtrees inside box are counted by node count
+        size_t count_in_box(const GeoBox &box) const {
+            return count_box_rec(box, this->root, GeoBox());
+        }
+
+        // call visitor(value, lon, lat) for each item inside box
+        template<class Visitor>
+        Visitor query_box(const GeoBox &box, Visitor visitor) const {
+            query_box_rec(box, this->root, GeoBox(), visitor);
+            return visitor;
+        }
+
+        // distance of the count-th item of get_nearby, or of the farthest if fewer, 0 if empty
+        uint32_t get_nearby_radius_by_count(float lon, float lat, size_t count) const {
+            NearbyScratch scratch;
+            return radius_by_count_impl(this->root, GeoLonLat(lon, lat), count, scratch);
+        }
+
+        // same as above, allocates nothing once scratch has grown
+        uint32_t get_nearby_radius_by_count(float lon, float lat, size_t count, NearbyScratch &scratch) const {
+            return radius_by_count_impl(this->root, GeoLonLat(lon, lat), count, scratch);
+        }
+
+        // rough radius of a disc holding count items around lonlat, from node counts and box
+        // areas only in O(depth), no item is visited. 0 if empty.
+        uint32_t estimate_radius_by_count(float lon, float lat, size_t count) const {
+            return estimate_radius_impl(this->root, GeoLonLat(lon, lat), count);
+        }
+
+        class Snapshot;
+
+        // read-only view of the current items in O(1). nodes are shared until the tree writes
+        // them, which copies the nodes on the path from the root instead. call from the thread
+        // writing the tree, the snapshot may then be read and destroyed from any thread.
+        Snapshot snapshot() {
+            return Snapshot(this);
+        }
+
+    private:
+        struct NineBox {
+            typedef const Node *ConstNodePtr;
+            ConstNodePtr NW, N, NE, W, C, E, SW, S, SE;
 
             NineBox moved(int dir) const {
                 switch (dir) {
@@ -389,98 +1460,766 @@ namespace geotools {
                 }
             }
 
-            static ConstNodePtr get_sub_node(ConstNodePtr node, int dir) {
-                if (node == NULL) {
-                    return NULL;
+            static ConstNodePtr get_sub_node(ConstNodePtr node, int dir) {
+                if (node == NULL) {
+                    return NULL;
+                }
+                return node->get(dir);
+            }
+        };
+
+        static NineBox root_ninebox(const Node *root) {
+            NineBox ninebox = {
+                NULL,       NULL,       NULL,
+                root,       root,       root,
+                NULL,       NULL,       NULL,
+            };
+            return ninebox;
+        }
+
+        // whether to stop before moving to next, i.e. the current center node is
+        // the smallest one that is guaranteed to cover required count
+        static bool is_nearby_center(const NineBox &next, uint32_t count) {
+            return node_size(next.C) < count;   // next.C may be NULL
+        }
+
+        // queries take the root to run on, see ConcurrentGeoTree
+        static vector<Item> nearby_impl(const Node *root, GeoLonLat lonlat, uint32_t count, uint32_t option) {
+            NearbyScratch scratch;
+            nearby_into(root, lonlat, count, option, scratch);
+            vector<Item> ans;
+            ans.swap(scratch.ans);
+            return ans;
+        }
+
+        // results in scratch.ans
+        static void nearby_into(
+            const Node *root, GeoLonLat lonlat, uint32_t count, uint32_t option, NearbyScratch &scratch)
+        {
+            if (count == 0 || root == NULL) {
+                scratch.ans.clear();
+                return;
+            }
+
+            collect_nearby(root, lonlat, count, scratch.leaves);
+            select_nearby(scratch, lonlat, count, option);
+        }
+
+        // leaves of the smallest nine box around lonlat whose center covers count
+        static void collect_nearby(const Node *root, GeoLonLat lonlat, uint32_t count, vector<const Node *> &leaves) {
+            NineBox ninebox = root_ninebox(root);
+            GeoFixed fixed(lonlat);
+            for (uint32_t depth = 0; !ninebox.C->is_leaf(); ++depth) {
+                NineBox next = ninebox.moved(fixed.dir(depth));
+                if (is_nearby_center(next, count)) {
+                    break;
+                }
+                ninebox = next;
+            }
+            collect_ninebox(ninebox, leaves);
+        }
+
+        // stops at the smallest node covering count around lonlat. the count of a disc is
+        // interpolated in log-log scale between that node and its child containing lonlat.
+        static uint32_t estimate_radius_impl(const Node *root, GeoLonLat lonlat, uint32_t count) {
+            if (count == 0 || root == NULL) {
+                return 0;
+            }
+
+            const Node *node = root;
+            const Node *child = NULL;
+            GeoBox box;
+            GeoBox child_box;
+            while (!node->is_leaf()) {
+                child_box = box;
+                child = node->get(child_box.locate_and_move(lonlat));
+                if (node_size(child) < count) {
+                    break;
+                }
+                node = child;
+                box = child_box;
+                child = NULL;
+            }
+
+            // count = c * area^slope through (child_box, child) and (box, node)
+            double area = box.area() * count / node->count;
+            if (child != NULL && count <= node->count) {
+                double slope = log((double)node->count / child->count) / log(box.area() / child_box.area());
+                area = child_box.area() * pow((double)count / child->count, 1.0 / slope);
+            }
+            double radius = std::min(sqrt(area / M_PI), M_PI * EARTH_RADIUS_IN_METERS);
+            return geo_round(radius);
+        }
+
+        // count-th distance of the nearby candidates, by selection over proxies and then over
+        // exact distances of items up to the count-th proxy band, no Item built and nothing sorted
+        static uint32_t radius_by_count_impl(
+            const Node *root, GeoLonLat lonlat, uint32_t count, NearbyScratch &scratch)
+        {
+            if (count == 0 || root == NULL) {
+                return 0;
+            }
+            collect_nearby(root, lonlat, count, scratch.leaves);
+            const vector<const Node *> &leaves = scratch.leaves;
+            size_t total = 0;
+            for (size_t i = 0; i < leaves.size(); ++i) {
+                total += leaves[i]->count;
+            }
+
+            vector<float> &proxies = scratch.proxies;
+            proxies.resize(total);
+            measure_proxy(leaves, lonlat, proxies.data());
+            float band = FLT_MAX;
+            if (total > count) {
+                vector<float> &tmp = scratch.selected;
+                tmp.assign(proxies.begin(), proxies.end());
+                nth_element(tmp.begin(), tmp.begin() + count - 1, tmp.end());
+                float kth = tmp[count - 1];
+                band = kth + 2.0e-6f * sqrt(kth) + 1e-12f;     // same eps as select_by_proxy
+            } else {
+                count = total;
+            }
+
+            vector<float> &lons = scratch.lons;
+            vector<float> &lats = scratch.lats;
+            lons.clear();
+            lats.clear();
+            size_t idx = 0;
+            for (size_t i = 0; i < leaves.size(); ++i) {
+                const typename Node::LeafType &leaf = leaves[i]->values;
+                for (size_t j = 0; j < leaf.size(); ++j, ++idx) {
+                    if (proxies[idx] <= band) {
+                        lons.push_back(leaf.lons[j]);
+                        lats.push_back(leaf.lats[j]);
+                    }
+                }
+            }
+            assert(lons.size() >= count);
+
+            vector<uint32_t> &dists = scratch.dists;
+            dists.resize(lons.size());
+            geo_distance_batch(lonlat.lon, lonlat.lat, lons.data(), lats.data(), lons.size(), dists.data());
+            nth_element(dists.begin(), dists.begin() + count - 1, dists.end());
+            return dists[count - 1];
+        }
+
+        // leaves of distinct nodes of ninebox
+        static void collect_ninebox(const NineBox &ninebox, vector<const Node *> &leaves) {
+            leaves.clear();
+            const Node *const *arr = &ninebox.NW;
+            for (size_t i = 0; i < 9; ++i) {
+                bool dup = false;
+                for (size_t j = 0; j < i && !dup; ++j) {
+                    dup = arr[i] == arr[j];
+                }
+                if (!dup) {
+                    collect_leaf(arr[i], leaves);
+                }
+            }
+        }
+
+        // count nearest items of scratch.leaves into scratch.ans
+        static void select_nearby(NearbyScratch &scratch, GeoLonLat lonlat, uint32_t count, uint32_t option) {
+            size_t total = 0;
+            for (size_t i = 0; i < scratch.leaves.size(); ++i) {
+                total += scratch.leaves[i]->count;
+            }
+
+            scratch.proxies.resize(total);
+            measure_proxy(scratch.leaves, lonlat, scratch.proxies.data());
+            select_by_proxy(scratch, lonlat, count);
+            if ((option & GEO_NO_SORT) == 0) {
+                sort(scratch.ans.begin(), scratch.ans.end());
+            }
+        }
+
+        typedef pair<uint64_t, size_t> BatchEntry;     // quad code and index of query
+
+        // queries of [begin, end) sorted by quad code. each query resumes the descent of the
+        // previous one from their common prefix, and queries ending at the same nine box reuse
+        // its leaves.
+        void nearby_batch_range(
+            const BatchEntry *begin, const BatchEntry *end, const GeoLonLat *points,
+            uint32_t count, uint32_t option, Item *out, size_t *sizes) const
+        {
+            NearbyScratch scratch;
+            vector<NineBox> path(1, root_ninebox(this->root));    // nine boxes by depth
+            uint32_t depth = 0;     // where the previous query stopped
+            bool has_prev = false;
+            uint64_t prev_code = 0;
+
+            for (const BatchEntry *it = begin; it != end; ++it) {
+                // the stop at depth also depends on the direction at depth, unless it is a leaf
+                uint32_t common = has_prev ? this->common_depth(prev_code, it->first) : 0;
+                if (!has_prev || depth > common || (depth == common && !path[depth].C->is_leaf())) {
+                    depth = std::min(depth, common);
+                    path.resize(depth + 1);
+                    while (!path[depth].C->is_leaf()) {
+                        NineBox next = path[depth].moved(this->code_dir(it->first, depth));
+                        if (is_nearby_center(next, count)) {
+                            break;
+                        }
+                        path.push_back(next);
+                        depth++;
+                    }
+                    collect_ninebox(path[depth], scratch.leaves);
+                }
+                has_prev = true;
+                prev_code = it->first;
+
+                select_nearby(scratch, points[it->second], count, option);
+                copy(scratch.ans.begin(), scratch.ans.end(), out + it->second * count);
+                sizes[it->second] = scratch.ans.size();
+            }
+        }
+
+        // number of leading levels two quad codes share
+        uint32_t common_depth(uint64_t a, uint64_t b) const {
+            uint32_t depth = 0;
+            while (depth < this->max_depth && this->code_dir(a, depth) == this->code_dir(b, depth)) {
+                depth++;
+            }
+            return depth;
+        }
+
+        // child direction at depth in quad code
+        int code_dir(uint64_t code, uint32_t depth) const {
+            static const int dirs[4] = {D_NW, D_NE, D_SE, D_SW};
+            return dirs[(code >> (2 * (this->max_depth - depth - 1))) & 3];
+        }
+
+        struct NodeDist {
+            double dist;    // lower bound
+            const Node *node;
+            GeoBox box;
+
+            NodeDist(double dist, const Node *node, const GeoBox &box)
+                : dist(dist), node(node), box(box)
+            {}
+
+            // for min heap
+            bool operator<(const NodeDist &rhs) const {
+                return this->dist > rhs.dist;
+            }
+        };
+
+    public:
+        // items in increasing distance, by best-first traversal that only expands
+        // nodes which may hold an item closer than the next one to yield
+        class NearestIterator {
+        public:
+            NearestIterator(const Node *root, GeoLonLat lonlat)
+                : lonlat(lonlat), nodes(), items(), dists()
+            {
+                if (root != NULL) {
+                    this->nodes.push(NodeDist(0, root, GeoBox()));
+                }
+            }
+
+            // false if no item left
+            bool next(Item &item) {
+                while (true) {
+                    bool has_item = !this->items.empty();
+                    // 1m of slack for float boxes and rounding of Item::dist, same as is_pruned
+                    if (!this->nodes.empty()
+                        && (!has_item || this->nodes.top().dist - 1.0 <= this->items.top().dist))
+                    {
+                        this->expand();
+                    } else if (has_item) {
+                        item = this->items.top();
+                        this->items.pop();
+                        return true;
+                    } else {
+                        return false;
+                    }
+                }
+            }
+
+        private:
+            struct Farther {
+                bool operator()(const Item &lhs, const Item &rhs) const {
+                    return lhs.dist > rhs.dist;
+                }
+            };
+
+            void expand() {
+                NodeDist top = this->nodes.top();
+                this->nodes.pop();
+
+                const Node *node = top.node;
+                if (node->is_leaf()) {
+                    const typename Node::LeafType &leaf = node->values;
+                    this->dists.resize(leaf.size());
+                    measure_leaf(node, this->lonlat, this->dists.data());
+                    for (size_t i = 0; i < leaf.size(); ++i) {
+                        Item item(leaf.keys[i], leaf.lons[i], leaf.lats[i]);
+                        item.dist = this->dists[i];
+                        this->items.push(item);
+                    }
+                } else {
+                    static const int dirs[4] = {D_NW, D_NE, D_SE, D_SW};
+                    for (size_t i = 0; i < 4; ++i) {
+                        const Node *child = node->get(dirs[i]);
+                        if (child != NULL) {
+                            GeoBox box = top.box.get(dirs[i]);
+                            this->nodes.push(NodeDist(box.min_distance(this->lonlat), child, box));
+                        }
+                    }
+                }
+            }
+
+            GeoLonLat lonlat;
+            priority_queue<NodeDist> nodes;     // nearest lower bound first
+            priority_queue<Item, vector<Item>, Farther> items;  // nearest first
+            vector<uint32_t> dists;     // of current leaf
+        };
+
+        // items of a GeoTree at the time of GeoTree::snapshot, unaffected by later writes.
+        // any number of threads may read it, and it never blocks the writer of the tree.
+        // it must be destroyed before the tree.
+        class Snapshot {
+        public:
+            Snapshot(const Snapshot &other)
+                : tree(other.tree), root(other.root), count(other.count), header(other.header)
+            {
+                this->retain();
+            }
+
+            Snapshot &operator=(const Snapshot &other) {
+                if (this != &other) {
+                    this->tree->release_snapshot(this->root);
+                    this->tree = other.tree;
+                    this->root = other.root;
+                    this->count = other.count;
+                    this->header = other.header;
+                    this->retain();
+                }
+                return *this;
+            }
+
+            ~Snapshot() {
+                this->tree->release_snapshot(this->root);
+            }
+
+            size_t size() const {
+                return this->count;
+            }
+
+            vector<Item> get_nearby(
+                float lon, float lat, size_t count, uint32_t option = GEO_OPT_NONE) const
+            {
+                return nearby_impl(this->root, GeoLonLat(lon, lat), count, option);
+            }
+
+            vector<Item> get_nearest(
+                float lon, float lat, size_t count, uint32_t option = GEO_OPT_NONE) const
+            {
+                return nearest_impl(this->root, GeoLonLat(lon, lat), count, option);
+            }
+
+            vector<Item> get_within_radius(
+                float lon, float lat, uint32_t meters,
+                uint32_t option = GEO_OPT_NONE, size_t limit = 0) const
+            {
+                return radius_impl(this->root, GeoLonLat(lon, lat), meters, option, limit);
+            }
+
+            size_t count_in_box(const GeoBox &box) const {
+                return count_box_rec(box, this->root, GeoBox());
+            }
+
+            template<class Visitor>
+            Visitor query_box(const GeoBox &box, Visitor visitor) const {
+                query_box_rec(box, this->root, GeoBox(), visitor);
+                return visitor;
+            }
+
+            uint32_t get_nearby_radius_by_count(float lon, float lat, size_t count) const {
+                NearbyScratch scratch;
+                return radius_by_count_impl(this->root, GeoLonLat(lon, lat), count, scratch);
+            }
+
+            // same file as GeoTree::save of the tree at the time of the snapshot
+            bool save(const char *path) const {
+                return save_impl(this->root, this->header, path);
+            }
+
+        private:
+            friend class GeoTree;
+
+            explicit Snapshot(GeoTree *tree) : tree(tree), root(tree->root), count(tree->size()) {
+                GeoFileHeader header = {
+                    FILE_MAGIC, FILE_VERSION, sizeof(T),
+                    tree->split_threshold, tree->merge_threshold, tree->max_depth,
+                    tree->size(), 0,
+                };
+                this->header = header;
+                this->retain();
+            }
+
+            void retain() {
+                if (this->root != NULL) {
+                    this->root->refs++;
                 }
-                return node->get(dir);
+                this->tree->snapshots++;
             }
+
+            GeoTree *tree;
+            const Node *root;
+            size_t count;
+            GeoFileHeader header;   // thresholds for save
         };
 
-        vector<Item> nearby_impl(GeoLonLat lonlat, uint32_t count, uint32_t option) const {
-            if (count == 0 || this->root == NULL) {
-                vector<Item> empty;
-                return empty;
-            }
+    private:
+        static vector<Item> nearest_impl(const Node *root, GeoLonLat lonlat, uint32_t count, uint32_t option) {
+            AcceptAll all;
+            return nearest_if_impl(root, lonlat, count, option, all);
+        }
 
-            NineBox ninebox = {
-                NULL,       NULL,       NULL,
-                this->root, this->root, this->root,
-                NULL,       NULL,       NULL,
-            };
-            GeoBox box;
+        // only items accepted by pred count, the search goes on until count of them are found
+        template<class Pred>
+        static vector<Item> nearest_if_impl(
+            const Node *root, GeoLonLat lonlat, uint32_t count, uint32_t option, Pred &pred)
+        {
+            vector<Item> heap;      // max heap of current k nearest
+            if (count == 0 || root == NULL) {
+                return heap;
+            }
+            heap.reserve(std::min<size_t>(count, root->count));
+            LeafPicks picks;        // of current leaf
+            if (!may_accept(pred, root)) {
+                return heap;
+            }
 
-            // find smallest center node that is guaranteed to cover required count
-            while (true) {
-                assert(ninebox.C != NULL);
-                if (ninebox.C->is_leaf()) {
-                    break;
+            priority_queue<NodeDist> frontier;
+            frontier.push(NodeDist(0, root, GeoBox()));
+            while (!frontier.empty()) {
+                NodeDist top = frontier.top();
+                frontier.pop();
+                if (is_pruned(heap, count, top.dist)) {
+                    break;      // all remaining nodes are farther
                 }
 
-                int dir = box.locate_and_move(lonlat);
-                NineBox new_ninebox = ninebox.moved(dir);
-                if (node_size(new_ninebox.C) < count) {     // new_ninebox.C may be NULL
-                    break;
+                const Node *node = top.node;
+                if (node->is_leaf()) {
+                    const typename Node::LeafType &leaf = node->values;
+                    pick_leaf(node, lonlat, pred, picks);
+                    for (size_t k = 0; k < picks.idxs.size(); ++k) {
+                        uint32_t dist = picks.dists[k];
+                        if (heap.size() == count && dist >= heap.front().dist) {
+                            continue;
+                        }
+                        size_t i = picks.idxs[k];
+                        Item item(leaf.keys[i], leaf.lons[i], leaf.lats[i]);
+                        item.dist = dist;
+                        heap_offer(heap, count, item);
+                    }
+                } else {
+                    static const int dirs[4] = {D_NW, D_NE, D_SE, D_SW};
+                    for (size_t i = 0; i < 4; ++i) {
+                        const Node *child = node->get(dirs[i]);
+                        if (child == NULL || !may_accept(pred, child)) {
+                            continue;
+                        }
+                        GeoBox box = top.box.get(dirs[i]);
+                        double dist = box.min_distance(lonlat);
+                        if (!is_pruned(heap, count, dist)) {
+                            frontier.push(NodeDist(dist, child, box));
+                        }
+                    }
                 }
+            }
+
+            if ((option & GEO_NO_SORT) == 0) {
+                sort_heap(heap.begin(), heap.end());
+            }
+            return heap;
+        }
 
-                ninebox = new_ninebox;
+        struct AcceptAll {
+            bool operator()(const T &) const {
+                return true;
             }
+        };
 
-            // remove duplicated node
-            const Node **arr = &ninebox.NW;
-            for (size_t i = 1; i < 9; ++i) {
-                for (size_t j = 0; j < i; ++j) {
-                    if (arr[i] == arr[j]) {
-                        arr[i] = NULL;
-                        break;
-                    }
+        // items having all bits of mask
+        struct AttrMask {
+            uint32_t mask;
+
+            explicit AttrMask(uint32_t mask) : mask(mask) {}
+
+            bool operator()(uint32_t attrs) const {
+                return (attrs & this->mask) == this->mask;
+            }
+        };
+
+        // whether a subtree may hold an accepted item
+        template<class Pred>
+        static bool may_accept(const Pred &, const Node *) {
+            return true;
+        }
+
+        static bool may_accept(const AttrMask &pred, const Node *node) {
+            return pred(node->attrs.get());
+        }
+
+        template<class Pred>
+        static bool accepts(Pred &pred, const typename Node::LeafType &values, size_t i) {
+            return pred(values.keys[i]);
+        }
+
+        static bool accepts(AttrMask &pred, const typename Node::LeafType &values, size_t i) {
+            return pred(values.attrs[i]);
+        }
+
+        // items of a leaf accepted by a predicate, with their distances
+        struct LeafPicks {
+            vector<uint32_t> idxs;
+            vector<float> lons;
+            vector<float> lats;
+            vector<uint32_t> dists;
+        };
+
+        static void pick_leaf(const Node *leaf, GeoLonLat lonlat, AcceptAll &, LeafPicks &picks) {
+            size_t size = leaf->values.size();
+            picks.idxs.resize(size);
+            for (size_t i = 0; i < size; ++i) {
+                picks.idxs[i] = i;
+            }
+            picks.dists.resize(size);
+            measure_leaf(leaf, lonlat, picks.dists.data());
+        }
+
+        // predicate first, only accepted items are measured
+        template<class Pred>
+        static void pick_leaf(const Node *leaf, GeoLonLat lonlat, Pred &pred, LeafPicks &picks) {
+            const typename Node::LeafType &values = leaf->values;
+            picks.idxs.clear();
+            picks.lons.clear();
+            picks.lats.clear();
+            for (size_t i = 0; i < values.size(); ++i) {
+                if (accepts(pred, values, i)) {
+                    picks.idxs.push_back(i);
+                    picks.lons.push_back(values.lons[i]);
+                    picks.lats.push_back(values.lats[i]);
                 }
             }
+            picks.dists.resize(picks.idxs.size());
+            geo_distance_batch(
+                lonlat.lon, lonlat.lat, picks.lons.data(), picks.lats.data(), picks.idxs.size(), picks.dists.data());
+        }
 
-            return fetch_items(arr, 9, lonlat, count, option);
+        // whether a node with lower bound distance can not improve the heap
+        static bool is_pruned(const vector<Item> &heap, uint32_t count, double lower_bound) {
+            // 1m of slack for float boxes and rounding of Item::dist
+            return heap.size() == count && lower_bound - 1.0 > heap.front().dist;
         }
 
-        static vector<Item> fetch_items(
-            const Node **arr, size_t size, GeoLonLat lonlat, uint32_t count, uint32_t option)
-        {
+        static void heap_offer(vector<Item> &heap, uint32_t count, const Item &item) {
+            if (heap.size() < count) {
+                heap.push_back(item);
+                push_heap(heap.begin(), heap.end());
+            } else if (item.dist < heap.front().dist) {
+                pop_heap(heap.begin(), heap.end());
+                heap.back() = item;
+                push_heap(heap.begin(), heap.end());
+            }
+        }
+
+        static void collect_item(const Node *node, vector<Item> &data, size_t limit = SIZE_MAX) {
+            if (node == NULL || data.size() >= limit) {
+                return;
+            }
+
+            if (node->is_leaf()) {
+                const typename Node::LeafType &leaf = node->values;
+                size_t size = std::min(leaf.size(), limit - data.size());
+                for (size_t i = 0; i < size; ++i) {
+                    data.push_back(Item(leaf.keys[i], leaf.lons[i], leaf.lats[i]));
+                }
+            } else {
+                collect_item(node->NW, data, limit);
+                collect_item(node->NE, data, limit);
+                collect_item(node->SE, data, limit);
+                collect_item(node->SW, data, limit);
+            }
+        }
+
+        struct GeoRadiusCtx {
+            GeoLonLat lonlat;
+            uint32_t meters;
+            uint32_t option;
+            size_t limit;
+            AttrMask filter;    // mask 0 accepts all
             vector<Item> ans;
+            vector<uint32_t> dists;     // of current leaf
 
-            for (size_t i = 0; i < size; ++i) {
-                collect_item(arr[i], ans);
+            GeoRadiusCtx(GeoLonLat lonlat, uint32_t meters, uint32_t option, size_t limit, uint32_t mask)
+                : lonlat(lonlat), meters(meters), option(option), limit(limit != 0 ? limit : SIZE_MAX),
+                filter(mask), ans(), dists()
+            {}
+
+            bool is_full() const {
+                return this->ans.size() >= this->limit;
             }
+        };
 
-            measure_distance(ans, lonlat);
-            truncate_by_distance(ans, count);
-            if ((option & GEO_NO_SORT) == 0) {
-                sort(ans.begin(), ans.end());
+        static vector<Item> radius_impl(
+            const Node *root, GeoLonLat lonlat, uint32_t meters, uint32_t option, size_t limit,
+            uint32_t mask = 0)
+        {
+            GeoRadiusCtx ctx(lonlat, meters, option, limit, mask);
+            if (root != NULL) {
+                radius_rec(ctx, root, GeoBox());
             }
-            return ans;
+            if ((option & (GEO_NO_SORT | GEO_NO_DIST)) == 0) {
+                sort(ctx.ans.begin(), ctx.ans.end());
+            }
+            return ctx.ans;
         }
 
-        static void collect_item(const Node *node, vector<Item> &data) {
-            if (node == NULL) {
+        static void radius_rec(GeoRadiusCtx &ctx, const Node *node, const GeoBox &box) {
+            if (node == NULL || ctx.is_full() || !ctx.filter(node->attrs.get())) {
+                return;
+            }
+
+            // 1m of slack for float boxes and rounding of Item::dist
+            if (box.min_distance(ctx.lonlat) - 1.0 > ctx.meters) {
+                return;
+            }
+
+            // whole subtree is inside the disc
+            bool inside = box.max_distance(ctx.lonlat) + 1.0 <= ctx.meters;
+            if (inside && (ctx.option & GEO_NO_DIST) != 0 && ctx.filter.mask == 0) {
+                collect_item(node, ctx.ans, ctx.limit);
                 return;
             }
 
             if (node->is_leaf()) {
-                for (typename Node::MapType::const_iterator it = node->values.begin();
-                    it != node->values.end(); ++it)
-                {
-                    const GeoLonLat &lonlat = it->second;
-                    data.push_back(Item(it->first, lonlat.lon, lonlat.lat));
+                const typename Node::LeafType &leaf = node->values;
+                ctx.dists.resize(leaf.size());
+                measure_leaf(node, ctx.lonlat, ctx.dists.data());
+                for (size_t i = 0; i < leaf.size() && !ctx.is_full(); ++i) {
+                    uint32_t dist = ctx.dists[i];
+                    if ((inside || dist <= ctx.meters) && ctx.filter(leaf.attrs[i])) {
+                        ctx.ans.push_back(Item(leaf.keys[i], leaf.lons[i], leaf.lats[i]));
+                        if ((ctx.option & GEO_NO_DIST) == 0) {
+                            ctx.ans.back().dist = dist;
+                        }
+                    }
                 }
             } else {
-                collect_item(node->NW, data);
-                collect_item(node->NE, data);
-                collect_item(node->SE, data);
-                collect_item(node->SW, data);
+                radius_rec(ctx, node->NW, box.get(D_NW));
+                radius_rec(ctx, node->NE, box.get(D_NE));
+                radius_rec(ctx, node->SE, box.get(D_SE));
+                radius_rec(ctx, node->SW, box.get(D_SW));
+            }
+        }
+
+        static void collect_leaf(const Node *node, vector<const Node *> &leaves) {
+            if (node == NULL) {
+                return;
+            }
+
+            if (node->is_leaf()) {
+                leaves.push_back(node);
+            } else {
+                collect_leaf(node->NW, leaves);
+                collect_leaf(node->NE, leaves);
+                collect_leaf(node->SE, leaves);
+                collect_leaf(node->SW, leaves);
+            }
+        }
+
+        static void measure_leaf(const Node *leaf, GeoLonLat lonlat, uint32_t *dists) {
+            const typename Node::LeafType &values = leaf->values;
+            geo_distance_batch(
+                lonlat.lon, lonlat.lat, values.lons.data(), values.lats.data(), values.size(), dists);
+        }
+
+        // squared chord lengths of all leaves concatenated, no trig involved
+        static void measure_proxy(const vector<const Node *> &leaves, GeoLonLat lonlat, float *proxies) {
+            double qx, qy, qz;
+            geo_to_xyz(lonlat.lon, lonlat.lat, qx, qy, qz);
+            const float fx = qx, fy = qy, fz = qz;
+            for (size_t i = 0; i < leaves.size(); ++i) {
+                const typename Node::LeafType &leaf = leaves[i]->values;
+                const float *xs = leaf.xs.data();
+                const float *ys = leaf.ys.data();
+                const float *zs = leaf.zs.data();
+                for (size_t j = 0; j < leaf.size(); ++j) {
+                    float dx = xs[j] - fx;
+                    float dy = ys[j] - fy;
+                    float dz = zs[j] - fz;
+                    proxies[j] = dx * dx + dy * dy + dz * dz;
+                }
+                proxies += leaf.size();
+            }
+        }
+
+        // items of the count smallest distances. ranking is done by proxy, only items near the
+        // count-th proxy, where float error may reorder them, are ranked by exact distance.
+        // of scratch.leaves and scratch.proxies into scratch.ans
+        static void select_by_proxy(NearbyScratch &scratch, GeoLonLat lonlat, uint32_t count) {
+            assert(count > 0);
+            const vector<const Node *> &leaves = scratch.leaves;
+            const vector<float> &proxies = scratch.proxies;
+            float sure = FLT_MAX;   // proxy below this is surely selected
+            float band = FLT_MAX;   // proxy above this is surely dropped
+            if (proxies.size() > count) {
+                vector<float> &tmp = scratch.selected;
+                tmp.assign(proxies.begin(), proxies.end());
+                nth_element(tmp.begin(), tmp.begin() + count - 1, tmp.end());
+                float kth = tmp[count - 1];
+                // float unit vectors are off by ~2e-7, so chord^2 is off by ~4e-7 * chord,
+                // eps covers the error of both sides
+                float eps = 2.0e-6f * sqrt(kth) + 1e-12f;
+                sure = kth - eps;
+                band = kth + eps;
+            }
+
+            // survivors first, then items in band
+            vector<Item> &ans = scratch.ans;
+            vector<Item> &tied = scratch.tied;
+            ans.clear();
+            tied.clear();
+            ans.reserve(std::min<size_t>(count, proxies.size()));
+            size_t idx = 0;
+            for (size_t i = 0; i < leaves.size(); ++i) {
+                const typename Node::LeafType &leaf = leaves[i]->values;
+                for (size_t j = 0; j < leaf.size(); ++j, ++idx) {
+                    float proxy = proxies[idx];
+                    if (proxy < sure) {
+                        ans.push_back(Item(leaf.keys[j], leaf.lons[j], leaf.lats[j]));
+                    } else if (proxy <= band) {
+                        tied.push_back(Item(leaf.keys[j], leaf.lons[j], leaf.lats[j]));
+                    }
+                }
+            }
+
+            measure_distance(scratch, ans, lonlat);
+            if (!tied.empty()) {
+                measure_distance(scratch, tied, lonlat);
+                truncate_by_distance(tied, count - ans.size());
+                ans.insert(ans.end(), tied.begin(), tied.end());
             }
+            assert(ans.size() == std::min<size_t>(count, proxies.size()));
         }
 
-        static void measure_distance(vector<Item> &data, GeoLonLat lonlat) {
+        static void measure_distance(NearbyScratch &scratch, vector<Item> &data, GeoLonLat lonlat) {
+            vector<float> &lons = scratch.lons;
+            vector<float> &lats = scratch.lats;
+            vector<uint32_t> &dists = scratch.dists;
+            lons.resize(data.size());
+            lats.resize(data.size());
+            dists.resize(data.size());
+            for (size_t i = 0; i < data.size(); ++i) {
+                lons[i] = data[i].lon;
+                lats[i] = data[i].lat;
+            }
+            geo_distance_batch(lonlat.lon, lonlat.lat, lons.data(), lats.data(), data.size(), dists.data());
             for (size_t i = 0; i < data.size(); ++i) {
-                Item &item = data[i];
-                item.dist = geo_round(geo_distance(item.lon, item.lat, lonlat.lon, lonlat.lat));
+                data[i].dist = dists[i];
             }
         }
 
@@ -493,20 +2232,291 @@ namespace geotools {
             }
         }
 
-        GeoNode<T> *insert_rec(GeoInsertCtx &ctx, GeoNode<T> *node) {
-            if (node == NULL) {
-                node = new GeoNode<T>(GEONODE_LEAF);
+        static size_t count_box_rec(const GeoBox &query, const Node *node, const GeoBox &box) {
+            if (node == NULL || !query.intersects(box)) {
+                return 0;
+            }
+            if (query.contains(box)) {
+                return node->count;
+            }
+
+            if (node->is_leaf()) {
+                const typename Node::LeafType &leaf = node->values;
+                size_t count = 0;
+                for (size_t i = 0; i < leaf.size(); ++i) {
+                    count += query.contains(leaf.lonlat(i));
+                }
+                return count;
+            } else {
+                return count_box_rec(query, node->NW, box.get(D_NW))
+                    + count_box_rec(query, node->NE, box.get(D_NE))
+                    + count_box_rec(query, node->SE, box.get(D_SE))
+                    + count_box_rec(query, node->SW, box.get(D_SW));
+            }
+        }
+
+        template<class Visitor>
+        static void query_box_rec(const GeoBox &query, const Node *node, const GeoBox &box, Visitor &visitor) {
+            if (node == NULL || !query.intersects(box)) {
+                return;
+            }
+
+            if (node->is_leaf()) {
+                // no per-point test if the leaf is inside query
+                bool inside = query.contains(box);
+                const typename Node::LeafType &leaf = node->values;
+                for (size_t i = 0; i < leaf.size(); ++i) {
+                    if (inside || query.contains(leaf.lonlat(i))) {
+                        visitor(leaf.keys[i], leaf.lons[i], leaf.lats[i]);
+                    }
+                }
+            } else {
+                query_box_rec(query, node->NW, box.get(D_NW), visitor);
+                query_box_rec(query, node->NE, box.get(D_NE), visitor);
+                query_box_rec(query, node->SE, box.get(D_SE), visitor);
+                query_box_rec(query, node->SW, box.get(D_SW), visitor);
+            }
+        }
+
+        typedef typename MapType::value_type MapValue;
+        typedef pair<uint64_t, const MapValue *> BulkEntry;
+
+        // child directions of each level from the root, 2 bits per level, NW, NE, SE, SW as
+        // 0 to 3 so that every subtree is a contiguous range of sorted codes. with s = !north
+        // and e = east the 2 bits are (s, e ^ s), interleaved from the fixed point bits at once.
+        uint64_t quad_code(GeoLonLat lonlat) const {
+            assert(0 < this->max_depth && this->max_depth <= 32);
+            GeoFixed fixed(lonlat);
+            uint32_t south = ~fixed.y;
+            return GeoFixed::interleave(fixed.x ^ south, south) >> (64 - 2 * this->max_depth);
+        }
+
+        Node *bulk_build(const BulkEntry *begin, const BulkEntry *end, uint32_t depth) {
+            assert(begin < end);
+            Node *node = this->alloc.alloc(GEONODE_LEAF);
+            size_t count = end - begin;
+            if (count <= this->split_threshold || depth >= this->max_depth) {
+                for (const BulkEntry *it = begin; it != end; ++it) {
+                    node->must_add(it->second->first, it->second->second);
+                }
+                return node;
+            }
+
+            node->type = GEONODE_INNER;
+            static const int dirs[4] = {D_NW, D_NE, D_SE, D_SW};
+            uint32_t shift = 2 * (this->max_depth - depth - 1);
+            const BulkEntry *child_begin = begin;
+            for (uint32_t i = 0; i < 4; ++i) {
+                const BulkEntry *child_end = child_begin;
+                while (child_end != end && ((child_end->first >> shift) & 3) == i) {
+                    ++child_end;
+                }
+                if (child_begin != child_end) {
+                    node->get(dirs[i]) = this->bulk_build(child_begin, child_end, depth + 1);
+                }
+                child_begin = child_end;
+            }
+            assert(child_begin == end);
+            node->update_count();
+            return node;
+        }
+
+        static bool save_impl(const Node *root, GeoFileHeader header, const char *path) {
+            BOOST_STATIC_ASSERT(boost::is_pod<T>::value);
+            GeoByteWriter out;
+            out.put(header);
+            if (root != NULL) {
+                save_node(out, root);
+            }
+            header.body_size = out.buf.size() - sizeof(header);
+            memcpy(out.buf.data(), &header, sizeof(header));
+            out.put(geo_checksum(out.buf.data(), out.buf.size()));
+            return geo_write_file(path, out.buf);
+        }
+
+        // type, children bits of an inner node, count, attrs, then arrays of a leaf
+        static void save_node(GeoByteWriter &out, const Node *node) {
+            static const int dirs[4] = {D_NW, D_NE, D_SE, D_SW};
+            uint8_t children = 0;
+            for (uint32_t i = 0; i < 4; ++i) {
+                children |= (node->get(dirs[i]) != NULL) << i;
+            }
+            out.put(node->type);
+            out.put(children);
+            out.put(node->count);
+            out.put(node->attrs.get());
+
+            if (node->is_leaf()) {
+                const typename Node::LeafType &leaf = node->values;
+                out.put_array(leaf.keys.data(), leaf.size());
+                out.put_array(leaf.lons.data(), leaf.size());
+                out.put_array(leaf.lats.data(), leaf.size());
+                out.put_array(leaf.xs.data(), leaf.size());
+                out.put_array(leaf.ys.data(), leaf.size());
+                out.put_array(leaf.zs.data(), leaf.size());
+                save_attrs(out, leaf.attrs, leaf.size());
+            } else {
+                for (uint32_t i = 0; i < 4; ++i) {
+                    if (children & (1 << i)) {
+                        save_node(out, node->get(dirs[i]));
+                    }
+                }
+            }
+        }
+
+        // node is linked before its children are read, so a failed load is freed by clear()
+        bool load_node(GeoByteReader &reader, Node *&node, uint32_t depth) {
+            uint8_t type, children;
+            uint32_t count, attrs;
+            if (!reader.get(type) || !reader.get(children) || !reader.get(count) || !reader.get(attrs)
+                || (type != GEONODE_LEAF && type != GEONODE_INNER) || count == 0 || depth > this->max_depth)
+            {
+                return false;
+            }
+            node = this->alloc.alloc(type);
+
+            if (type == GEONODE_LEAF) {
+                typename Node::LeafType &leaf = node->values;
+                if (!reader.get_vector(leaf.keys, count)
+                    || !reader.get_vector(leaf.lons, count) || !reader.get_vector(leaf.lats, count)
+                    || !reader.get_vector(leaf.xs, count) || !reader.get_vector(leaf.ys, count)
+                    || !reader.get_vector(leaf.zs, count) || !load_attrs(reader, leaf.attrs, count))
+                {
+                    return false;
+                }
+                leaf.reindex();
+                node->count = count;
+                node->attrs.set(leaf.attrs.all());
+                for (size_t i = 0; i < leaf.size(); ++i) {
+                    if (!this->geos.insert(make_pair(leaf.keys[i], leaf.lonlat(i))).second) {
+                        return false;   // duplicated value
+                    }
+                }
+            } else {
+                if (children == 0 || children > 15) {
+                    return false;
+                }
+                static const int dirs[4] = {D_NW, D_NE, D_SE, D_SW};
+                for (uint32_t i = 0; i < 4; ++i) {
+                    if ((children & (1 << i)) && !this->load_node(reader, node->get(dirs[i]), depth + 1)) {
+                        return false;
+                    }
+                }
+                node->update_count();
+            }
+            return node->count == count && node->attrs.get() == attrs;
+        }
+
+        // trees without attrs write them as 0, so that files are the same for both
+        static void save_attrs(GeoByteWriter &out, const GeoAttrArray<true> &attrs, size_t size) {
+            out.put_array(attrs.bits.data(), size);
+        }
+
+        static void save_attrs(GeoByteWriter &out, const GeoAttrArray<false> &, size_t size) {
+            out.buf.resize(out.buf.size() + sizeof(uint32_t) * size, 0);
+        }
+
+        static bool load_attrs(GeoByteReader &reader, GeoAttrArray<true> &attrs, size_t size) {
+            return reader.get_vector(attrs.bits, size);
+        }
+
+        // a file with attrs is not loaded into a tree without them
+        static bool load_attrs(GeoByteReader &reader, GeoAttrArray<false> &, size_t size) {
+            for (size_t i = 0; i < size; ++i) {
+                uint32_t bits;
+                if (!reader.get(bits) || bits != 0) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // attrs of an existing value are replaced if not NULL
+        bool insert_impl(const T &value, GeoLonLat lonlat, const uint32_t *attrs) {
+            assert(lonlat.is_valid());
+            this->reclaim();
+
+            typename MapType::iterator it = this->geos.find(value);
+            if (it != this->geos.end()) {
+                this->move_existing(it, lonlat, attrs);
+                return false;
+            }
+
+            GeoInsertCtx ctx(value, lonlat, attrs != NULL ? *attrs : 0);
+            this->geos.insert(make_pair(value, ctx.lonlat));
+            this->root = this->insert_rec(ctx, this->root);
+            return true;
+        }
+
+        // update in place if the leaf is unchanged, otherwise re-route below the lowest common ancestor.
+        // attrs are replaced if not NULL
+        void move_existing(typename MapType::iterator it, GeoLonLat to, const uint32_t *attrs = NULL) {
+            const T &value = it->first;
+            GeoLonLat from = it->second;
+            it->second = to;
+
+            GeoInsertCtx ctx(value, to);
+            uint32_t common = ctx.fixed.common_depth(GeoFixed(from));
+            Node **link = &this->root;
+            while (true) {
+                Node *node = *link = this->own(*link);
+                assert(node != NULL);
+                if (node->is_leaf()) {
+                    size_t idx = node->values.find(value);
+                    assert(idx != node->values.size());
+                    node->values.set(idx, to);
+                    if (attrs != NULL && *attrs != node->values.attrs[idx]) {
+                        GeoInsertCtx attrs_ctx(value, to, *attrs);
+                        this->root = this->set_attrs_rec(attrs_ctx, this->root);
+                    }
+                    return;
+                }
+
+                if (ctx.depth == common) {
+                    break;
+                }
+                link = &node->get(ctx.locate_and_move());
+            }
+
+            GeoInsertCtx rem_ctx(value, from);
+            rem_ctx.depth = ctx.depth;
+            Node *rest = this->remove_rec(rem_ctx, *link);
+            ctx.attrs = attrs != NULL ? *attrs : rem_ctx.attrs;
+            *link = this->insert_rec(ctx, rest);
+            // unions above the link are stale if the bits changed
+            if (ctx.attrs != rem_ctx.attrs) {
+                GeoInsertCtx attrs_ctx(value, to, *attrs);
+                this->root = this->set_attrs_rec(attrs_ctx, this->root);
+            }
+        }
+
+        // set attrs of an existing value and refresh the unions on its path
+        Node *set_attrs_rec(GeoInsertCtx &ctx, Node *node) {
+            assert(node != NULL);
+            node = this->own(node);
+            if (node->is_leaf()) {
+                size_t idx = node->values.find(ctx.value);
+                assert(idx != node->values.size());
+                node->values.attrs.set(idx, ctx.attrs);
+                node->attrs.set(node->values.attrs.all());
+            } else {
+                Node *&c = node->get(ctx.locate_and_move());
+                c = this->set_attrs_rec(ctx, c);
+                node->update_count();
             }
+            return node;
+        }
+
+        Node *insert_rec(GeoInsertCtx &ctx, Node *node) {
+            node = node == NULL ? this->alloc.alloc(GEONODE_LEAF) : this->own(node);
 
             if (node->is_leaf()) {
-                node->add(ctx.value, ctx.lonlat);
+                node->add(ctx.value, ctx.lonlat, ctx.attrs);
                 if (node->count > this->split_threshold && ctx.depth < this->max_depth) {
-                    this->split(ctx.box, node);
+                    this->split(ctx.depth, node);
                 }
             } else {
-                ctx.depth++;
-                int dir = ctx.box.locate_and_move(ctx.lonlat);
-                GeoNode<T> *&c = node->get(dir);
+                Node *&c = node->get(ctx.locate_and_move());
                 c = insert_rec(ctx, c);
                 node->update_count();
             }
@@ -514,57 +2524,153 @@ namespace geotools {
             return node;
         }
 
-        static GeoNode<T> *leaf_add(GeoNode<T> *node, const T &value, GeoLonLat lonlat) {
+        Node *leaf_add(Node *node, const T &value, GeoLonLat lonlat, uint32_t attrs) {
             if (node == NULL) {
-                node = new GeoNode<T>(GEONODE_LEAF);
+                node = this->alloc.alloc(GEONODE_LEAF);
             }
-            node->add(value, lonlat);
+            node->must_add(value, lonlat, attrs);
             return node;
         }
 
-        static void split(const GeoBox &box, GeoNode<T> *node) {
+        // leaf at depth into an inner node
+        void split(uint32_t depth, Node *node) {
             assert(node->is_leaf());
-            for (typename GeoNode<T>::MapType::iterator it = node->values.begin();
-                it != node->values.end(); ++it)
-            {
-                const T &key = it->first;
-                const GeoLonLat &lonlat = it->second;
-
-                int dir = box.locate(lonlat);
-                GeoNode<T> *&c = node->get(dir);
-                c = leaf_add(c, key, lonlat);
+            const typename Node::LeafType &leaf = node->values;
+            for (size_t i = 0; i < leaf.size(); ++i) {
+                GeoLonLat lonlat = leaf.lonlat(i);
+                int dir = GeoFixed(lonlat).dir(depth);
+                Node *&c = node->get(dir);
+                c = this->leaf_add(c, leaf.keys[i], lonlat, leaf.attrs[i]);
             }
             node->type = GEONODE_INNER;
             node->values.clear();
         }
 
-        GeoNode<T> *remove_rec(GeoInsertCtx &ctx, GeoNode<T> *node) {
+        Node *remove_rec(GeoInsertCtx &ctx, Node *node) {
             assert(node != NULL);
+            node = this->own(node);
 
             if (node->is_leaf()) {
-                node->must_remove(ctx.value);
+                ctx.attrs = node->must_remove(ctx.value);
                 // remove empty node
                 if (node->count == 0) {
-                    delete node;
+                    this->alloc.free(node);
                     node = NULL;
                 }
-                // TODO: merge
             } else {
-                int dir = ctx.box.locate_and_move(ctx.lonlat);
-                GeoNode<T> *&c = node->get(dir);
+                Node *&c = node->get(ctx.locate_and_move());
                 c = remove_rec(ctx, c);
                 node->update_count();
                 // remove node when count reaches 0
                 if (node->count == 0) {
                     assert(!node->NW && !node->NE && !node->SE && !node->SW);
-                    delete node;
+                    this->alloc.free(node);
                     node = NULL;
+                } else if (node->count <= this->merge_threshold) {
+                    this->merge(node);
                 }
             }
 
             return node;
         }
 
+        // turn an inner node into a leaf with all items of its subtree
+        void merge(Node *node) {
+            assert(!node->is_leaf());
+            typename Node::LeafType leaf;
+            this->merge_rec(node->NW, leaf);
+            this->merge_rec(node->NE, leaf);
+            this->merge_rec(node->SE, leaf);
+            this->merge_rec(node->SW, leaf);
+            this->release(node->NW);
+            this->release(node->NE);
+            this->release(node->SE);
+            this->release(node->SW);
+            node->NW = node->NE = node->SE = node->SW = NULL;
+
+            node->type = GEONODE_LEAF;
+            node->values.swap(leaf);
+            assert(node->count == node->values.size());
+        }
+
+        // items of a subtree, which may be shared with snapshots and is left intact
+        static void merge_rec(const Node *node, typename Node::LeafType &leaf) {
+            if (node == NULL) {
+                return;
+            }
+
+            if (node->is_leaf()) {
+                leaf.append(node->values);
+            } else {
+                merge_rec(node->NW, leaf);
+                merge_rec(node->NE, leaf);
+                merge_rec(node->SE, leaf);
+                merge_rec(node->SW, leaf);
+            }
+        }
+
+        // writable version of a node. a node shared with a snapshot is copied, the copy takes
+        // a reference on each child, so only nodes on the written path are ever copied.
+        Node *own(Node *node) {
+            if (node == NULL || node->refs.load() == 1) {
+                return node;
+            }
+
+            Node *copy = this->alloc.alloc(node->type);
+            copy->count = node->count;
+            copy->attrs = node->attrs;
+            copy->values = node->values;
+            static const int dirs[4] = {D_NW, D_NE, D_SE, D_SW};
+            for (size_t i = 0; i < 4; ++i) {
+                Node *child = node->get(dirs[i]);
+                if (child != NULL) {
+                    child->refs++;
+                    copy->get(dirs[i]) = child;
+                }
+            }
+            this->release(node);
+            return copy;
+        }
+
+        // drop a reference, the last one frees the node and drops its children
+        void release(Node *node) {
+            if (node == NULL || node->refs.fetch_sub(1) != 1) {
+                return;
+            }
+            this->release(node->NW);
+            this->release(node->NE);
+            this->release(node->SE);
+            this->release(node->SW);
+            this->alloc.free(node);
+        }
+
+        // free roots of destroyed snapshots, on the writer side
+        void reclaim() {
+            if (!this->has_orphans.load()) {
+                return;
+            }
+            vector<Node *> roots;
+            {
+                std::lock_guard<std::mutex> lock(this->orphan_mutex);
+                roots.swap(this->orphans);
+                this->has_orphans = false;
+            }
+            for (size_t i = 0; i < roots.size(); ++i) {
+                roots[i]->refs++;   // dropped to 0 by the snapshot
+                this->release(roots[i]);
+            }
+        }
+
+        // called by destroyed snapshots from any thread
+        void release_snapshot(const Node *root) {
+            if (root != NULL && root->refs.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(this->orphan_mutex);
+                this->orphans.push_back(const_cast<Node *>(root));
+                this->has_orphans = true;
+            }
+            this->snapshots--;
+        }
+
     // for tests
 #ifdef TWOBLUECUBES_SINGLE_INCLUDE_CATCH_HPP_INCLUDED
     public:
@@ -578,18 +2684,31 @@ namespace geotools {
         }
 
     private:
-        void verify_node(const GeoNode<T> *node, const GeoBox &box) const {
+        void verify_node(const Node *node, const GeoBox &box) const {
             if (node == NULL) {
                 return;
             }
 
+            // only shared with snapshots
+            CHECK(node->refs.load() >= 1);
+            if (this->snapshots.load() == 0 && !this->has_orphans.load()) {
+                CHECK(node->refs.load() == 1);
+            }
+
             if (node->type == GEONODE_LEAF) {
-                CHECK(node->count == node->values.size());
-                for (typename GeoNode<T>::MapType::const_iterator it = node->values.begin();
-                    it != node->values.end(); ++it)
-                {
-                    const T &key = it->first;
-                    const GeoLonLat &lonlat = it->second;
+                const typename Node::LeafType &leaf = node->values;
+                CHECK(node->count == leaf.size());
+                CHECK(leaf.lons.size() == leaf.size());
+                CHECK(leaf.lats.size() == leaf.size());
+                CHECK(leaf.attrs.fits(leaf.size()));
+                CHECK(node->attrs.get() == leaf.attrs.all());
+                CHECK((leaf.index == NULL || leaf.index->size() == leaf.size()));
+                for (size_t i = 0; i < leaf.size(); ++i) {
+                    const T &key = leaf.keys[i];
+                    GeoLonLat lonlat = leaf.lonlat(i);
+                    if (leaf.index != NULL) {
+                        CHECK(leaf.find(key) == i);
+                    }
 
                     CHECK(box.contains(lonlat));
                     typename MapType::const_iterator geoit = this->geos.find(key);
@@ -600,6 +2719,9 @@ namespace geotools {
                 CHECK(node->count
                     == node_size(node->NW) + node_size(node->NE)
                     + node_size(node->SE) + node_size(node->SW));
+                CHECK(node->attrs.get()
+                    == (Node::attrs_of(node->NW) | Node::attrs_of(node->NE)
+                    | Node::attrs_of(node->SE) | Node::attrs_of(node->SW)));
                 this->verify_node(node->NW, box.get(D_NW));
                 this->verify_node(node->NE, box.get(D_NE));
                 this->verify_node(node->SE, box.get(D_SE));
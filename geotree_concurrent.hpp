@@ -0,0 +1,328 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <stdint.h>
+#include <vector>
+#include <utility>
+
+#include <boost/atomic.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "geotree.hpp"
+
+
+namespace geotools {
+    using namespace std;
+
+    // grace periods for readers that take no lock, in the style of SRCU:
+    // readers count themselves on one of two sides, synchronize() flips the side
+    // and waits for the old side to drain. counters are striped by thread.
+    class GeoEpoch {
+    private:
+        static const size_t STRIPES = 32;
+
+        struct Stripe {
+            boost::atomic<uint32_t> active[2];
+            char padding[64 - 2 * sizeof(boost::atomic<uint32_t>)];     // one cache line each
+
+            Stripe() {
+                active[0] = 0;
+                active[1] = 0;
+            }
+        };
+
+        boost::atomic<uint64_t> epoch;
+        Stripe stripes[STRIPES];
+
+        Stripe &stripe_of_this_thread() {
+            size_t h = boost::hash<boost::thread::id>()(boost::this_thread::get_id());
+            return this->stripes[h % STRIPES];
+        }
+
+    public:
+        GeoEpoch() : epoch(0) {}
+
+        // read side critical section
+        class Guard {
+        public:
+            explicit Guard(GeoEpoch &epoch) : stripe(epoch.stripe_of_this_thread()), side(0) {
+                while (true) {
+                    this->side = epoch.epoch.load() & 1;
+                    this->stripe.active[this->side].fetch_add(1);
+                    // still the same side, any later synchronize() will wait for us
+                    if ((epoch.epoch.load() & 1) == this->side) {
+                        break;
+                    }
+                    this->stripe.active[this->side].fetch_sub(1);
+                }
+            }
+
+            ~Guard() {
+                this->stripe.active[this->side].fetch_sub(1, boost::memory_order_release);
+            }
+
+        private:
+            Guard(const Guard &);
+            Guard &operator=(const Guard &);
+
+            Stripe &stripe;
+            uint32_t side;
+        };
+
+        // wait until all readers entered before this call have left, callers must be serialized
+        void synchronize() {
+            uint32_t side = this->epoch.fetch_add(1) & 1;
+            for (size_t i = 0; i < STRIPES; ++i) {
+                while (this->stripes[i].active[side].load() != 0) {
+                    boost::this_thread::yield();
+                }
+            }
+        }
+    };
+
+    // GeoTree variant for read mostly workloads. readers never lock, they run on
+    // an immutable published version of the tree. writers are serialized by a mutex and write
+    // a GeoTree, whose published roots are held like snapshots: the nodes on the written path
+    // are copied by GeoTree's copy-on-write, then the new root is published and the old one is
+    // released after a grace period of GeoEpoch.
+    // each write copies the leaf it touches, keep split_threshold small.
+    template<class T, class Alloc = GeoNodePool<T> >
+    class ConcurrentGeoTree {
+    private:
+        typedef GeoTree<T, Alloc> Tree;
+        typedef typename Tree::Node Node;
+
+    public:
+        typedef typename Tree::Item Item;
+        typedef typename Tree::ItemRange ItemRange;
+        typedef typename Tree::NearbyScratch NearbyScratch;
+
+    private:
+        // writer side, guarded by write_mutex
+        boost::mutex write_mutex;
+        Tree tree;
+        vector<const Node *> retired;   // published before root, may be in use by readers
+        size_t reclaim_batch;
+
+        boost::atomic<const Node *> root;   // published
+        mutable GeoEpoch epoch;
+
+    public:
+        ConcurrentGeoTree(uint32_t split_threshold = 128)
+            : write_mutex(), tree(split_threshold), retired(), reclaim_batch(128), root(NULL), epoch()
+        {
+            this->root.store(this->retain(this->tree.root));
+        }
+
+        // no readers or writers may be running
+        ~ConcurrentGeoTree() {
+            this->retired.push_back(this->root.load());
+            this->free_retired();
+        }
+
+        void set_merge_threshold(uint32_t merge_threshold) {
+            boost::mutex::scoped_lock sl(this->write_mutex);
+            this->tree.set_merge_threshold(merge_threshold);
+        }
+
+        size_t size() const {
+            GeoEpoch::Guard guard(this->epoch);
+            return Node::count_of(this->published());
+        }
+
+        static bool is_valid(float lon, float lat) {
+            return GeoLonLat(lon, lat).is_valid();
+        }
+
+        // same as GeoTree::insert, an existing value keeps its attrs
+        bool insert(const T &value, float lon, float lat) {
+            boost::mutex::scoped_lock sl(this->write_mutex);
+            bool inserted = this->tree.insert(value, lon, lat);
+            this->publish();
+            return inserted;
+        }
+
+        bool insert(const T &value, float lon, float lat, uint32_t attrs) {
+            boost::mutex::scoped_lock sl(this->write_mutex);
+            bool inserted = this->tree.insert(value, lon, lat, attrs);
+            this->publish();
+            return inserted;
+        }
+
+        bool insert(const Item &item) {
+            return insert(item.value, item.lon, item.lat);
+        }
+
+        bool move(const T &value, float lon, float lat) {
+            boost::mutex::scoped_lock sl(this->write_mutex);
+            if (!this->tree.move(value, lon, lat)) {
+                return false;
+            }
+            this->publish();
+            return true;
+        }
+
+        bool erase(const T &value) {
+            boost::mutex::scoped_lock sl(this->write_mutex);
+            if (!this->tree.erase(value)) {
+                return false;
+            }
+            this->publish();
+            return true;
+        }
+
+        bool set_attrs(const T &value, uint32_t attrs) {
+            boost::mutex::scoped_lock sl(this->write_mutex);
+            if (!this->tree.set_attrs(value, attrs)) {
+                return false;
+            }
+            this->publish();
+            return true;
+        }
+
+        void clear() {
+            boost::mutex::scoped_lock sl(this->write_mutex);
+            this->tree.clear();
+            this->publish();
+            this->reclaim();
+        }
+
+        // replace content with items of [first, last), see GeoTree::bulk_load
+        template<class Iter>
+        void bulk_load(Iter first, Iter last) {
+            boost::mutex::scoped_lock sl(this->write_mutex);
+            this->tree.bulk_load(first, last);
+            this->publish();
+            this->reclaim();
+        }
+
+        vector<Item> get_nearby(
+            float lon, float lat, size_t count, uint32_t option = GEO_OPT_NONE) const
+        {
+            GeoEpoch::Guard guard(this->epoch);
+            return Tree::nearby_impl(this->published(), GeoLonLat(lon, lat), count, option);
+        }
+
+        // results are copied to scratch, they stay valid after writers reclaim the nodes
+        ItemRange get_nearby(
+            float lon, float lat, size_t count, NearbyScratch &scratch, uint32_t option = GEO_OPT_NONE) const
+        {
+            GeoEpoch::Guard guard(this->epoch);
+            Tree::nearby_into(this->published(), GeoLonLat(lon, lat), count, option, scratch);
+            return ItemRange(scratch.ans.data(), scratch.ans.data() + scratch.ans.size());
+        }
+
+        vector<Item> get_nearest(
+            float lon, float lat, size_t count, uint32_t option = GEO_OPT_NONE) const
+        {
+            GeoEpoch::Guard guard(this->epoch);
+            return Tree::nearest_impl(this->published(), GeoLonLat(lon, lat), count, option);
+        }
+
+        // see GeoTree::get_nearest_by_attrs
+        vector<Item> get_nearest_by_attrs(
+            float lon, float lat, size_t count, uint32_t mask, uint32_t option = GEO_OPT_NONE) const
+        {
+            BOOST_STATIC_ASSERT_MSG(Node::HAS_ATTRS, "tree keeps no attrs");
+            typename Tree::AttrMask pred(mask);
+            GeoEpoch::Guard guard(this->epoch);
+            return Tree::nearest_if_impl(this->published(), GeoLonLat(lon, lat), count, option, pred);
+        }
+
+        vector<Item> get_within_radius(
+            float lon, float lat, uint32_t meters,
+            uint32_t option = GEO_OPT_NONE, size_t limit = 0) const
+        {
+            GeoEpoch::Guard guard(this->epoch);
+            return Tree::radius_impl(this->published(), GeoLonLat(lon, lat), meters, option, limit);
+        }
+
+        // see GeoTree::get_within_radius_by_attrs
+        vector<Item> get_within_radius_by_attrs(
+            float lon, float lat, uint32_t meters, uint32_t mask,
+            uint32_t option = GEO_OPT_NONE, size_t limit = 0) const
+        {
+            BOOST_STATIC_ASSERT_MSG(Node::HAS_ATTRS, "tree keeps no attrs");
+            GeoEpoch::Guard guard(this->epoch);
+            return Tree::radius_impl(this->published(), GeoLonLat(lon, lat), meters, option, limit, mask);
+        }
+
+        size_t count_in_box(const GeoBox &box) const {
+            GeoEpoch::Guard guard(this->epoch);
+            return Tree::count_box_rec(box, this->published(), GeoBox());
+        }
+
+        // visitor runs inside the read side critical section and must not write to this tree
+        template<class Visitor>
+        Visitor query_box(const GeoBox &box, Visitor visitor) const {
+            GeoEpoch::Guard guard(this->epoch);
+            Tree::query_box_rec(box, this->published(), GeoBox(), visitor);
+            return visitor;
+        }
+
+        uint32_t get_nearby_radius_by_count(float lon, float lat, size_t count) const {
+            NearbyScratch scratch;
+            GeoEpoch::Guard guard(this->epoch);
+            return Tree::radius_by_count_impl(this->published(), GeoLonLat(lon, lat), count, scratch);
+        }
+
+    private:
+        ConcurrentGeoTree(const ConcurrentGeoTree &);
+        ConcurrentGeoTree &operator=(const ConcurrentGeoTree &);
+
+        const Node *published() const {
+            return this->root.load(boost::memory_order_acquire);
+        }
+
+        // a published root is held as a snapshot of tree, which copies the nodes it writes
+        const Node *retain(Node *root) {
+            if (root != NULL) {
+                root->refs++;
+            }
+            this->tree.snapshots++;
+            return root;
+        }
+
+        // readers move on to the current root of tree, the old root is retired
+        void publish() {
+            const Node *old = this->root.exchange(this->retain(this->tree.root), boost::memory_order_acq_rel);
+            this->retired.push_back(old);
+            if (this->retired.size() >= this->reclaim_batch) {
+                this->reclaim();
+            }
+        }
+
+        void reclaim() {
+            this->epoch.synchronize();
+            this->free_retired();
+        }
+
+        // nodes no longer shared are freed by tree
+        void free_retired() {
+            for (size_t i = 0; i < this->retired.size(); ++i) {
+                this->tree.release_snapshot(this->retired[i]);
+            }
+            this->retired.clear();
+            this->tree.reclaim();
+        }
+
+    // for tests
+#ifdef TWOBLUECUBES_SINGLE_INCLUDE_CATCH_HPP_INCLUDED
+    public:
+        void verify() {
+            boost::mutex::scoped_lock sl(this->write_mutex);
+            CHECK(this->root.load() == this->tree.root);
+            this->tree.verify();
+        }
+
+        typename Tree::MapType get_all() {
+            boost::mutex::scoped_lock sl(this->write_mutex);
+            return this->tree.get_all();
+        }
+#endif
+    };
+
+}   // namespace geotools
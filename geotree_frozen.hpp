@@ -0,0 +1,482 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdint.h>
+#include <queue>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/is_pod.hpp>
+
+#include "geotree.hpp"
+
+
+namespace geotools {
+    using namespace std;
+
+    // items of a subtree are [begin, begin + count) of the item arrays, for leaves and inner nodes
+    struct GeoFrozenNode {
+        uint32_t type;
+        uint32_t count;
+        uint32_t begin;
+        uint32_t children[4];   // NW, NE, SE, SW by node index, 0 for none as 0 is the root
+    };
+
+    // read-only GeoTree in a single pointer-free file: nodes in pre-order with children by
+    // index, and items as SoA arrays in leaf order. the file is mmapped and queried in place,
+    // so opening reads the nodes only, O(nodes), and processes opening the same file share one
+    // page cache copy. there is no nine box get_nearby, k nearest queries are exact.
+    template<class T>
+    class GeoFrozenTree {
+    public:
+        typedef GeoItem<T> Item;
+
+    private:
+        typedef GeoTree<T> Base;    // query helpers
+
+        enum {
+            FILE_MAGIC = 0x5a525447,    // "GTRZ", also tells byte order
+            FILE_VERSION = 1,
+        };
+
+        enum { SEC_NODES, SEC_KEYS, SEC_LONS, SEC_LATS, SECTIONS };
+
+        // sections start at 8 byte aligned offsets
+        struct Header {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t key_size;
+            uint32_t reserved;
+            uint64_t nodes;
+            uint64_t items;
+            uint64_t file_size;
+            uint64_t checksum;      // of all bytes after the header
+            uint64_t offsets[SECTIONS];
+        };
+
+        void *map;
+        size_t map_size;
+        const GeoFrozenNode *nodes;
+        size_t node_count;
+        size_t item_count;
+        const T *keys;
+        const float *lons;
+        const float *lats;
+
+    public:
+        GeoFrozenTree()
+            : map(NULL), map_size(0), nodes(NULL), node_count(0), item_count(0),
+            keys(NULL), lons(NULL), lats(NULL)
+        {}
+
+        ~GeoFrozenTree() {
+            this->close();
+        }
+
+        // T must be POD. false on io error
+        template<class Alloc>
+        static bool write(const GeoTree<T, Alloc> &tree, const char *path) {
+            BOOST_STATIC_ASSERT(boost::is_pod<T>::value);
+            vector<GeoFrozenNode> nodes;
+            vector<T> keys;
+            vector<float> lons;
+            vector<float> lats;
+            if (tree.root != NULL) {
+                freeze_rec(tree.root, nodes, keys, lons, lats);
+            }
+
+            Header header;
+            memset(&header, 0, sizeof(header));
+            header.magic = FILE_MAGIC;
+            header.version = FILE_VERSION;
+            header.key_size = sizeof(T);
+            header.nodes = nodes.size();
+            header.items = keys.size();
+
+            GeoByteWriter out;
+            out.put(header);
+            put_section(out, header, SEC_NODES, nodes);
+            put_section(out, header, SEC_KEYS, keys);
+            put_section(out, header, SEC_LONS, lons);
+            put_section(out, header, SEC_LATS, lats);
+            header.file_size = out.buf.size();
+            header.checksum = geo_checksum(out.buf.data() + sizeof(header), out.buf.size() - sizeof(header));
+            memcpy(out.buf.data(), &header, sizeof(header));
+            return geo_write_file(path, out.buf);
+        }
+
+        // map a file of write. the header, section bounds and every node are checked, so that
+        // queries stay inside the mapping, which reads the node section only. check also runs
+        // the checksum over the whole file for corrupted keys and coordinates.
+        bool open(const char *path, bool check = false) {
+            BOOST_STATIC_ASSERT(boost::is_pod<T>::value);
+            this->close();
+            int fd = ::open(path, O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+                ::close(fd);
+                return false;
+            }
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (map == MAP_FAILED) {
+                return false;
+            }
+
+            this->map = map;
+            this->map_size = st.st_size;
+            if (!this->attach(check)) {
+                this->close();
+                return false;
+            }
+            return true;
+        }
+
+        void close() {
+            if (this->map != NULL) {
+                munmap(this->map, this->map_size);
+            }
+            this->map = NULL;
+            this->map_size = 0;
+            this->nodes = NULL;
+            this->node_count = 0;
+            this->item_count = 0;
+            this->keys = NULL;
+            this->lons = NULL;
+            this->lats = NULL;
+        }
+
+        bool is_open() const {
+            return this->map != NULL;
+        }
+
+        size_t size() const {
+            return this->item_count;
+        }
+
+        // exact k nearest, same as GeoTree::get_nearest
+        vector<Item> get_nearest(
+            float lon, float lat, size_t count, uint32_t option = GEO_OPT_NONE) const
+        {
+            vector<Item> heap;
+            if (count == 0 || this->node_count == 0) {
+                return heap;
+            }
+            heap.reserve(std::min(count, this->item_count));
+            vector<uint32_t> dists;     // of current leaf
+            GeoLonLat lonlat(lon, lat);
+
+            priority_queue<NodeDist> frontier;
+            frontier.push(NodeDist(0, 0, GeoBox()));
+            while (!frontier.empty()) {
+                NodeDist top = frontier.top();
+                frontier.pop();
+                if (Base::is_pruned(heap, count, top.dist)) {
+                    break;      // all remaining nodes are farther
+                }
+
+                const GeoFrozenNode &node = this->nodes[top.idx];
+                if (node.type == GEONODE_LEAF) {
+                    dists.resize(node.count);
+                    geo_distance_batch(lon, lat, this->lons + node.begin, this->lats + node.begin,
+                        node.count, dists.data());
+                    for (size_t i = 0; i < node.count; ++i) {
+                        if (heap.size() == count && dists[i] >= heap.front().dist) {
+                            continue;
+                        }
+                        Base::heap_offer(heap, count, this->item_at(node.begin + i, dists[i]));
+                    }
+                } else {
+                    for (size_t i = 0; i < 4; ++i) {
+                        if (node.children[i] == 0) {
+                            continue;
+                        }
+                        GeoBox box = top.box.get(DIRS[i]);
+                        double dist = box.min_distance(lonlat);
+                        if (!Base::is_pruned(heap, count, dist)) {
+                            frontier.push(NodeDist(dist, node.children[i], box));
+                        }
+                    }
+                }
+            }
+
+            if ((option & GEO_NO_SORT) == 0) {
+                sort_heap(heap.begin(), heap.end());
+            }
+            return heap;
+        }
+
+        // all items within meters, at most limit items (not necessarily the nearest) if limit != 0
+        vector<Item> get_within_radius(
+            float lon, float lat, uint32_t meters,
+            uint32_t option = GEO_OPT_NONE, size_t limit = 0) const
+        {
+            RadiusCtx ctx(GeoLonLat(lon, lat), meters, option, limit);
+            if (this->node_count != 0) {
+                this->radius_rec(ctx, 0, GeoBox());
+            }
+            if ((option & (GEO_NO_SORT | GEO_NO_DIST)) == 0) {
+                sort(ctx.ans.begin(), ctx.ans.end());
+            }
+            return ctx.ans;
+        }
+
+        size_t count_in_box(const GeoBox &box) const {
+            return this->node_count != 0 ? this->count_box_rec(box, 0, GeoBox()) : 0;
+        }
+
+        // call visitor(value, lon, lat) for each item inside box
+        template<class Visitor>
+        Visitor query_box(const GeoBox &box, Visitor visitor) const {
+            if (this->node_count != 0) {
+                this->query_box_rec(box, 0, GeoBox(), visitor);
+            }
+            return visitor;
+        }
+
+    private:
+        GeoFrozenTree(const GeoFrozenTree &);
+        GeoFrozenTree &operator=(const GeoFrozenTree &);
+
+        static const int DIRS[4];
+
+        struct NodeDist {
+            double dist;    // lower bound
+            uint32_t idx;
+            GeoBox box;
+
+            NodeDist(double dist, uint32_t idx, const GeoBox &box) : dist(dist), idx(idx), box(box) {}
+
+            // for min heap
+            bool operator<(const NodeDist &rhs) const {
+                return this->dist > rhs.dist;
+            }
+        };
+
+        struct RadiusCtx {
+            GeoLonLat lonlat;
+            uint32_t meters;
+            uint32_t option;
+            size_t limit;
+            vector<Item> ans;
+            vector<uint32_t> dists;     // of current leaf
+
+            RadiusCtx(GeoLonLat lonlat, uint32_t meters, uint32_t option, size_t limit)
+                : lonlat(lonlat), meters(meters), option(option), limit(limit != 0 ? limit : SIZE_MAX),
+                ans(), dists()
+            {}
+
+            bool is_full() const {
+                return this->ans.size() >= this->limit;
+            }
+        };
+
+        template<class V>
+        static void put_section(GeoByteWriter &out, Header &header, size_t sec, const vector<V> &values) {
+            out.buf.resize((out.buf.size() + 7) / 8 * 8);
+            header.offsets[sec] = out.buf.size();
+            out.put_array(values.data(), values.size());
+        }
+
+        template<class Node>
+        static uint32_t freeze_rec(
+            const Node *node, vector<GeoFrozenNode> &nodes,
+            vector<T> &keys, vector<float> &lons, vector<float> &lats)
+        {
+            uint32_t idx = nodes.size();
+            GeoFrozenNode frozen = {node->type, node->count, (uint32_t)keys.size(), {0, 0, 0, 0}};
+            nodes.push_back(frozen);
+            if (node->is_leaf()) {
+                const typename Node::LeafType &leaf = node->values;
+                keys.insert(keys.end(), leaf.keys.begin(), leaf.keys.end());
+                lons.insert(lons.end(), leaf.lons.begin(), leaf.lons.end());
+                lats.insert(lats.end(), leaf.lats.begin(), leaf.lats.end());
+            } else {
+                for (size_t i = 0; i < 4; ++i) {
+                    const Node *child = node->get(DIRS[i]);
+                    if (child != NULL) {
+                        frozen.children[i] = freeze_rec(child, nodes, keys, lons, lats);
+                    }
+                }
+                nodes[idx] = frozen;
+            }
+            return idx;
+        }
+
+        template<class V>
+        bool section(const Header &header, size_t sec, size_t size, const V *&ptr) const {
+            uint64_t offset = header.offsets[sec];
+            if (offset % 8 != 0 || offset > this->map_size || size > (this->map_size - offset) / sizeof(V)) {
+                return false;
+            }
+            ptr = reinterpret_cast<const V *>(static_cast<const char *>(this->map) + offset);
+            return true;
+        }
+
+        bool attach(bool check) {
+            Header header;
+            memcpy(&header, this->map, sizeof(header));
+            if (header.magic != FILE_MAGIC || header.version != FILE_VERSION
+                || header.key_size != sizeof(T) || header.file_size != this->map_size
+                || header.items > UINT32_MAX || header.nodes > UINT32_MAX)
+            {
+                return false;
+            }
+            if (!this->section(header, SEC_NODES, header.nodes, this->nodes)
+                || !this->section(header, SEC_KEYS, header.items, this->keys)
+                || !this->section(header, SEC_LONS, header.items, this->lons)
+                || !this->section(header, SEC_LATS, header.items, this->lats))
+            {
+                return false;
+            }
+            this->node_count = header.nodes;
+            this->item_count = header.items;
+
+            if (check) {
+                const char *bytes = static_cast<const char *>(this->map);
+                if (geo_checksum(bytes + sizeof(header), this->map_size - sizeof(header)) != header.checksum) {
+                    return false;
+                }
+            }
+            return this->node_count == 0 ? this->item_count == 0 : this->is_valid_node(0, 0, this->item_count, 0);
+        }
+
+        // children follow their parent and split its item range in order, so each node is
+        // visited once. no deeper than GeoFixed can locate.
+        bool is_valid_node(uint32_t idx, size_t begin, size_t count, uint32_t depth) const {
+            const GeoFrozenNode &node = this->nodes[idx];
+            if (node.begin != begin || node.count != count || count == 0 || depth > 32) {
+                return false;
+            }
+            if (node.type == GEONODE_LEAF) {
+                return true;
+            } else if (node.type != GEONODE_INNER) {
+                return false;
+            }
+
+            size_t end = begin;
+            for (size_t i = 0; i < 4; ++i) {
+                uint32_t child = node.children[i];
+                if (child == 0) {
+                    continue;
+                }
+                if (child <= idx || child >= this->node_count
+                    || !this->is_valid_node(child, end, this->nodes[child].count, depth + 1))
+                {
+                    return false;
+                }
+                end += this->nodes[child].count;
+            }
+            return end == begin + count;
+        }
+
+        Item item_at(size_t i, uint32_t dist = 0) const {
+            Item item(this->keys[i], this->lons[i], this->lats[i]);
+            item.dist = dist;
+            return item;
+        }
+
+        void radius_rec(RadiusCtx &ctx, uint32_t idx, const GeoBox &box) const {
+            if (ctx.is_full()) {
+                return;
+            }
+
+            // 1m of slack for float boxes and rounding of Item::dist
+            if (box.min_distance(ctx.lonlat) - 1.0 > ctx.meters) {
+                return;
+            }
+
+            // whole subtree is inside the disc, its items are one range
+            const GeoFrozenNode &node = this->nodes[idx];
+            bool inside = box.max_distance(ctx.lonlat) + 1.0 <= ctx.meters;
+            if (inside && (ctx.option & GEO_NO_DIST) != 0) {
+                size_t end = node.begin + std::min<size_t>(node.count, ctx.limit - ctx.ans.size());
+                for (size_t i = node.begin; i < end; ++i) {
+                    ctx.ans.push_back(this->item_at(i));
+                }
+                return;
+            }
+
+            if (node.type == GEONODE_LEAF) {
+                ctx.dists.resize(node.count);
+                geo_distance_batch(ctx.lonlat.lon, ctx.lonlat.lat, this->lons + node.begin, this->lats + node.begin,
+                    node.count, ctx.dists.data());
+                for (size_t i = 0; i < node.count && !ctx.is_full(); ++i) {
+                    uint32_t dist = ctx.dists[i];
+                    if (inside || dist <= ctx.meters) {
+                        ctx.ans.push_back(this->item_at(node.begin + i, (ctx.option & GEO_NO_DIST) ? 0 : dist));
+                    }
+                }
+            } else {
+                for (size_t i = 0; i < 4; ++i) {
+                    if (node.children[i] != 0) {
+                        this->radius_rec(ctx, node.children[i], box.get(DIRS[i]));
+                    }
+                }
+            }
+        }
+
+        size_t count_box_rec(const GeoBox &query, uint32_t idx, const GeoBox &box) const {
+            if (!query.intersects(box)) {
+                return 0;
+            }
+            const GeoFrozenNode &node = this->nodes[idx];
+            if (query.contains(box)) {
+                return node.count;
+            }
+
+            size_t count = 0;
+            if (node.type == GEONODE_LEAF) {
+                for (size_t i = node.begin; i < node.begin + node.count; ++i) {
+                    count += query.contains(GeoLonLat(this->lons[i], this->lats[i]));
+                }
+            } else {
+                for (size_t i = 0; i < 4; ++i) {
+                    if (node.children[i] != 0) {
+                        count += this->count_box_rec(query, node.children[i], box.get(DIRS[i]));
+                    }
+                }
+            }
+            return count;
+        }
+
+        template<class Visitor>
+        void query_box_rec(const GeoBox &query, uint32_t idx, const GeoBox &box, Visitor &visitor) const {
+            if (!query.intersects(box)) {
+                return;
+            }
+
+            const GeoFrozenNode &node = this->nodes[idx];
+            if (node.type == GEONODE_LEAF) {
+                // no per-point test if the leaf is inside query
+                bool inside = query.contains(box);
+                for (size_t i = node.begin; i < node.begin + node.count; ++i) {
+                    GeoLonLat lonlat(this->lons[i], this->lats[i]);
+                    if (inside || query.contains(lonlat)) {
+                        visitor(this->keys[i], lonlat.lon, lonlat.lat);
+                    }
+                }
+            } else {
+                for (size_t i = 0; i < 4; ++i) {
+                    if (node.children[i] != 0) {
+                        this->query_box_rec(query, node.children[i], box.get(DIRS[i]), visitor);
+                    }
+                }
+            }
+        }
+    };
+
+    template<class T>
+    const int GeoFrozenTree<T>::DIRS[4] = {D_NW, D_NE, D_SE, D_SW};
+
+}   // namespace geotools
@@ -0,0 +1,324 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <stdint.h>
+#include <vector>
+#include <utility>
+
+#include <boost/atomic.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "geotree.hpp"
+
+
+namespace geotools {
+    using namespace std;
+
+    // GeoTree partitioned into a grid of 4^level shards, the cells of the first levels
+    // of GeoBox subdivision. each shard has its own tree and read/write lock, writers in
+    // different cells never contend. the shard of each value is kept in a map striped by
+    // value hash, which also serializes writes to the same value.
+    // a value moving between shards is briefly invisible to readers.
+    // there is no get_nearby, the nine box approximation of GeoTree stops at shard borders.
+    // k nearest queries are exact instead, as GeoTree::get_nearest, and always sorted.
+    template<class T>
+    class ShardedGeoTree {
+    public:
+        typedef GeoTree<T> Tree;
+        typedef typename Tree::Item Item;
+
+    private:
+        struct Shard {
+            mutable boost::shared_mutex mutex;
+            Tree tree;
+            GeoBox box;
+            boost::atomic<size_t> count;    // tree.size() without the lock
+
+            Shard(uint32_t split_threshold, const GeoBox &box)
+                : mutex(), tree(split_threshold), box(box), count(0)
+            {}
+        };
+
+        struct OwnerStripe {
+            boost::mutex mutex;
+            boost::unordered_map<T, uint32_t> shards;     // value -> shard index
+        };
+
+        typedef boost::shared_lock<boost::shared_mutex> ReadLock;
+        typedef boost::unique_lock<boost::shared_mutex> WriteLock;
+
+        static const size_t OWNER_STRIPES = 64;
+
+        uint32_t level;
+        vector<Shard *> shards;
+        OwnerStripe owners[OWNER_STRIPES];
+
+    public:
+        // 4^level shards, level 4 cells are 22.5 by 11.25 degrees
+        ShardedGeoTree(uint32_t split_threshold = 128, uint32_t level = 4)
+            : level(level), shards()
+        {
+            assert(level <= 8);
+            uint32_t side = 1 << level;
+            for (uint32_t y = 0; y < side; ++y) {
+                for (uint32_t x = 0; x < side; ++x) {
+                    this->shards.push_back(new Shard(split_threshold, cell_box(x, y, level)));
+                }
+            }
+        }
+
+        ~ShardedGeoTree() {
+            for (size_t i = 0; i < this->shards.size(); ++i) {
+                delete this->shards[i];
+            }
+        }
+
+        size_t shard_count() const {
+            return this->shards.size();
+        }
+
+        size_t size() const {
+            size_t total = 0;
+            for (size_t i = 0; i < this->shards.size(); ++i) {
+                total += this->shards[i]->count.load();
+            }
+            return total;
+        }
+
+        static bool is_valid(float lon, float lat) {
+            return GeoLonLat(lon, lat).is_valid();
+        }
+
+        bool insert(const T &value, float lon, float lat) {
+            assert(is_valid(lon, lat));
+            uint32_t to = this->shard_of(GeoLonLat(lon, lat));
+
+            OwnerStripe &owner = this->owner_of(value);
+            boost::mutex::scoped_lock sl(owner.mutex);
+            typename boost::unordered_map<T, uint32_t>::iterator it = owner.shards.find(value);
+            bool exists = it != owner.shards.end();
+            if (exists && it->second != to) {
+                this->shard_erase(it->second, value);
+            }
+            this->shard_insert(to, value, lon, lat);
+            owner.shards[value] = to;
+            return !exists;
+        }
+
+        bool insert(const Item &item) {
+            return insert(item.value, item.lon, item.lat);
+        }
+
+        bool move(const T &value, float lon, float lat) {
+            assert(is_valid(lon, lat));
+            uint32_t to = this->shard_of(GeoLonLat(lon, lat));
+
+            OwnerStripe &owner = this->owner_of(value);
+            boost::mutex::scoped_lock sl(owner.mutex);
+            typename boost::unordered_map<T, uint32_t>::iterator it = owner.shards.find(value);
+            if (it == owner.shards.end()) {
+                return false;
+            }
+            if (it->second != to) {
+                this->shard_erase(it->second, value);
+                it->second = to;
+            }
+            this->shard_insert(to, value, lon, lat);
+            return true;
+        }
+
+        bool erase(const T &value) {
+            OwnerStripe &owner = this->owner_of(value);
+            boost::mutex::scoped_lock sl(owner.mutex);
+            typename boost::unordered_map<T, uint32_t>::iterator it = owner.shards.find(value);
+            if (it == owner.shards.end()) {
+                return false;
+            }
+            this->shard_erase(it->second, value);
+            owner.shards.erase(it);
+            return true;
+        }
+
+        // exact k nearest, merged from the shards whose box may hold a closer item than the current k-th
+        vector<Item> get_nearest(float lon, float lat, size_t count) const {
+            GeoLonLat lonlat(lon, lat);
+            vector<Item> ans;
+            if (count == 0) {
+                return ans;
+            }
+
+            // nearest shards first
+            vector<pair<double, uint32_t> > order;
+            for (size_t i = 0; i < this->shards.size(); ++i) {
+                if (this->shards[i]->count.load() != 0) {
+                    order.push_back(make_pair(this->shards[i]->box.min_distance(lonlat), i));
+                }
+            }
+            sort(order.begin(), order.end());
+
+            for (size_t i = 0; i < order.size(); ++i) {
+                // 1m of slack for float boxes and rounding of Item::dist, same as GeoTree::is_pruned
+                if (ans.size() == count && order[i].first - 1.0 > ans.back().dist) {
+                    break;
+                }
+
+                const Shard &shard = *this->shards[order[i].second];
+                vector<Item> got;
+                {
+                    ReadLock rl(shard.mutex);
+                    got = shard.tree.get_nearest(lon, lat, count);
+                }
+                ans = merge_nearest(ans, got, count);
+            }
+            return ans;
+        }
+
+        vector<Item> get_within_radius(
+            float lon, float lat, uint32_t meters,
+            uint32_t option = GEO_OPT_NONE, size_t limit = 0) const
+        {
+            GeoLonLat lonlat(lon, lat);
+            vector<Item> ans;
+            for (size_t i = 0; i < this->shards.size(); ++i) {
+                const Shard &shard = *this->shards[i];
+                if (shard.count.load() == 0 || shard.box.min_distance(lonlat) - 1.0 > meters) {
+                    continue;
+                }
+
+                vector<Item> got;
+                {
+                    ReadLock rl(shard.mutex);
+                    got = shard.tree.get_within_radius(lon, lat, meters, option | GEO_NO_SORT,
+                        limit == 0 ? 0 : limit - ans.size());
+                }
+                ans.insert(ans.end(), got.begin(), got.end());
+                if (limit != 0 && ans.size() >= limit) {
+                    break;
+                }
+            }
+
+            if ((option & (GEO_NO_SORT | GEO_NO_DIST)) == 0) {
+                sort(ans.begin(), ans.end());
+            }
+            return ans;
+        }
+
+        size_t count_in_box(const GeoBox &box) const {
+            size_t total = 0;
+            for (size_t i = 0; i < this->shards.size(); ++i) {
+                const Shard &shard = *this->shards[i];
+                if (shard.count.load() == 0 || !shard.box.intersects(box)) {
+                    continue;
+                }
+                ReadLock rl(shard.mutex);
+                total += shard.tree.count_in_box(box);
+            }
+            return total;
+        }
+
+        // distance of the count-th nearest item, or of the farthest if fewer, 0 if empty
+        uint32_t get_nearest_radius_by_count(float lon, float lat, size_t count) const {
+            vector<Item> items = get_nearest(lon, lat, count);
+            if (items.empty()) {
+                return 0;
+            } else {
+                return items.back().dist;
+            }
+        }
+
+        // shard index of a position
+        uint32_t shard_of(GeoLonLat lonlat) const {
+            if (this->level == 0) {
+                return 0;
+            }
+            // the cell of each level is the next bit of the fixed point coordinates
+            GeoFixed fixed(lonlat);
+            uint32_t x = fixed.x >> (32 - this->level);
+            uint32_t y = fixed.y >> (32 - this->level);
+            return (y << this->level) | x;
+        }
+
+    private:
+        ShardedGeoTree(const ShardedGeoTree &);
+        ShardedGeoTree &operator=(const ShardedGeoTree &);
+
+        static GeoBox cell_box(uint32_t x, uint32_t y, uint32_t level) {
+            GeoBox box;
+            for (uint32_t i = level; i > 0; --i) {
+                bool east = (x >> (i - 1)) & 1;
+                bool north = (y >> (i - 1)) & 1;
+                box = box.get((east ? D_E : D_W) | (north ? D_N : D_S));
+            }
+            return box;
+        }
+
+        OwnerStripe &owner_of(const T &value) {
+            return this->owners[boost::hash<T>()(value) % OWNER_STRIPES];
+        }
+
+        void shard_insert(uint32_t idx, const T &value, float lon, float lat) {
+            Shard &shard = *this->shards[idx];
+            WriteLock wl(shard.mutex);
+            shard.tree.insert(value, lon, lat);
+            shard.count.store(shard.tree.size());
+        }
+
+        void shard_erase(uint32_t idx, const T &value) {
+            Shard &shard = *this->shards[idx];
+            WriteLock wl(shard.mutex);
+            bool erased = shard.tree.erase(value);
+            assert(erased);
+            (void)erased;
+            shard.count.store(shard.tree.size());
+        }
+
+        // k nearest of two sorted lists
+        static vector<Item> merge_nearest(const vector<Item> &a, const vector<Item> &b, size_t count) {
+            vector<Item> ans;
+            ans.reserve(std::min(count, a.size() + b.size()));
+            size_t i = 0;
+            size_t j = 0;
+            while (ans.size() < count && (i < a.size() || j < b.size())) {
+                if (j == b.size() || (i < a.size() && !(b[j] < a[i]))) {
+                    ans.push_back(a[i++]);
+                } else {
+                    ans.push_back(b[j++]);
+                }
+            }
+            return ans;
+        }
+
+    // for tests
+#ifdef TWOBLUECUBES_SINGLE_INCLUDE_CATCH_HPP_INCLUDED
+    public:
+        void verify() {
+            size_t owned = 0;
+            for (size_t i = 0; i < OWNER_STRIPES; ++i) {
+                owned += this->owners[i].shards.size();
+            }
+            CHECK(owned == this->size());
+
+            for (size_t i = 0; i < this->shards.size(); ++i) {
+                Shard &shard = *this->shards[i];
+                shard.tree.verify();
+                CHECK(shard.count.load() == shard.tree.size());
+
+                typename Tree::MapType all = shard.tree.get_all();
+                for (typename Tree::MapType::const_iterator it = all.begin(); it != all.end(); ++it) {
+                    CHECK(shard.box.contains(it->second));
+                    CHECK(this->shard_of(it->second) == i);
+                    OwnerStripe &owner = this->owner_of(it->first);
+                    REQUIRE(owner.shards.count(it->first) == 1);
+                    CHECK(owner.shards[it->first] == i);
+                }
+            }
+        }
+#endif
+    };
+
+}   // namespace geotools
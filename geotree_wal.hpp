@@ -0,0 +1,655 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/type_traits/is_pod.hpp>
+
+#include "geotree.hpp"
+
+
+namespace geotools {
+    using namespace std;
+
+    struct GeoLogOptions {
+        uint32_t flush_ms;          // group commit window after the first pending record
+        size_t group_bytes;         // flush without waiting for the window when this much is pending
+        bool fsync;                 // fdatasync each group, otherwise a group is only written
+        size_t checkpoint_records;  // background checkpoint after this many records, 0 for none
+
+        GeoLogOptions()
+            : flush_ms(5), group_bytes(1 << 20), fsync(true), checkpoint_records(1 << 20)
+        {}
+    };
+
+    // GeoTree with an append-only log of its writes under path.log.<gen>, and checkpoints
+    // written by GeoTree::save to path.ckpt.<gen>, which covers the logs before gen. a write
+    // applies to the tree and appends its record to a memory buffer, a background thread
+    // writes the buffer in groups of records, one write and fdatasync each. another thread
+    // saves a snapshot of the tree every checkpoint_records records and then deletes the log
+    // it covers. open recovers the tree as the latest checkpoint plus the logs after it, up to
+    // a torn or corrupted group at the end of the last log.
+    // writes and queries are single threaded as with GeoTree, snapshot() may be read anywhere.
+    template<class T>
+    class GeoLoggedTree {
+    public:
+        typedef GeoTree<T, GeoNodePool<T, true> > Tree;     // with attrs, which are logged
+        typedef typename Tree::Item Item;
+        typedef typename Tree::Snapshot Snapshot;
+
+    private:
+        enum {
+            LOG_MAGIC = 0x474c4f47,     // "GOLG", also tells byte order
+            LOG_VERSION = 1,
+            GROUP_MAGIC = 0x47524f50,
+        };
+
+        enum { OP_INSERT = 1, OP_MOVE, OP_ERASE, OP_ATTRS, OP_PLACE };     // place is insert keeping attrs
+
+        // of replaying a log file
+        enum {
+            REPLAY_OK,
+            REPLAY_TORN,    // a group or header fails its checks, the write of it was cut short
+            REPLAY_BAD,     // a record of an intact group does not apply
+        };
+
+        struct LogHeader {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t key_size;
+            uint32_t reserved;
+            uint64_t gen;
+        };
+
+        // followed by size bytes of records
+        struct GroupHeader {
+            uint32_t magic;
+            uint32_t records;
+            uint64_t size;
+            uint64_t checksum;
+        };
+
+        // records of one log file
+        struct Batch {
+            uint64_t gen;
+            uint64_t records;
+            GeoByteWriter out;
+
+            explicit Batch(uint64_t gen) : gen(gen), records(0), out() {}
+        };
+
+        typedef boost::mutex::scoped_lock Lock;
+
+        Tree tree;
+        string path;
+        GeoLogOptions options;
+        bool opened;
+
+        // all below are guarded by mutex
+        boost::mutex mutex;
+        boost::condition_variable wakeup;   // for the threads
+        boost::condition_variable done;     // for waiters of flushes and checkpoints
+        vector<Batch> pending;
+        size_t pending_bytes;
+        size_t record_begin;        // offset of the record being appended
+        uint64_t appended;          // records appended
+        uint64_t flushed;           // records written
+        uint64_t gen;               // log file of new records
+        uint64_t file_gen;          // log file open in the flusher, 0 for none
+        uint64_t first_gen;         // oldest log file not deleted
+        size_t syncers;
+        bool stopping;
+        bool failed;                // io error of the log, records are no longer appended
+
+        // checkpoint requested by the writer and taken by the checkpointer
+        Snapshot *ckpt_snapshot;
+        uint64_t ckpt_gen;          // log files before it are covered
+        bool ckpt_running;
+        uint64_t ckpt_done;         // checkpoints finished, successful or not
+        bool ckpt_ok;               // of the last one
+        size_t since_ckpt;          // records, writer only
+
+        int fd;                     // flusher only
+        boost::thread flusher;
+        boost::thread checkpointer;
+
+    public:
+        GeoLoggedTree(uint32_t split_threshold = 128)
+            : tree(split_threshold), path(), options(), opened(false),
+            mutex(), wakeup(), done(), pending(), pending_bytes(0), record_begin(0), appended(0), flushed(0),
+            gen(0), file_gen(0), first_gen(0), syncers(0), stopping(false), failed(false),
+            ckpt_snapshot(NULL), ckpt_gen(0), ckpt_running(false), ckpt_done(0), ckpt_ok(true), since_ckpt(0),
+            fd(-1), flusher(), checkpointer()
+        {}
+
+        ~GeoLoggedTree() {
+            this->close();
+        }
+
+        // recover from the latest checkpoint and the logs after it, then start logging. a
+        // recovered log is checkpointed before returning. false on io error, a checkpoint that
+        // fails to load, or a log corrupted anywhere but at the end of the last one.
+        bool open(const char *path, const GeoLogOptions &options = GeoLogOptions()) {
+            BOOST_STATIC_ASSERT(boost::is_pod<T>::value);
+            assert(!this->opened);
+            this->path = path;
+            this->options = options;
+            this->tree.clear();
+
+            vector<uint64_t> ckpts;
+            vector<uint64_t> gens;
+            if (!this->list_ckpts(ckpts) || !this->list_logs(gens)) {
+                return false;
+            }
+            uint64_t ckpt_gen = ckpts.empty() ? 0 : ckpts.back();
+            if (ckpt_gen != 0 && !this->tree.load(this->ckpt_path(ckpt_gen).c_str())) {
+                return false;
+            }
+            // logs before the checkpoint are left by a crash before their deletion
+            size_t live = lower_bound(gens.begin(), gens.end(), ckpt_gen) - gens.begin();
+            for (size_t i = live; i < gens.size(); ++i) {
+                int status = this->replay(gens[i]);
+                if (status == REPLAY_OK) {
+                    continue;
+                }
+                // a torn group is only acknowledged by sync if followed by anything
+                if (status == REPLAY_BAD || i + 1 < gens.size()) {
+                    this->tree.clear();
+                    return false;
+                }
+            }
+
+            this->pending.clear();
+            this->pending_bytes = 0;
+            this->appended = this->flushed = 0;
+            this->gen = std::max(gens.empty() ? 1 : gens.back() + 1, ckpt_gen);
+            this->pending.push_back(Batch(this->gen));
+            this->file_gen = 0;
+            this->first_gen = gens.empty() ? this->gen : gens.front();
+            this->syncers = 0;
+            this->stopping = false;
+            this->failed = false;
+            this->ckpt_snapshot = NULL;
+            this->ckpt_running = false;
+            this->ckpt_done = 0;
+            this->ckpt_ok = true;
+            this->since_ckpt = 0;
+            this->flusher = boost::thread(&GeoLoggedTree::flush_loop, this);
+            this->checkpointer = boost::thread(&GeoLoggedTree::checkpoint_loop, this);
+            this->opened = true;
+            return gens.empty() || this->checkpoint();
+        }
+
+        // flush all records, finish a running checkpoint and stop the threads
+        void close() {
+            if (!this->opened) {
+                return;
+            }
+            {
+                Lock lock(this->mutex);
+                this->stopping = true;
+                this->wakeup.notify_all();
+            }
+            this->flusher.join();
+            this->checkpointer.join();
+            this->opened = false;
+        }
+
+        bool is_open() const {
+            return this->opened;
+        }
+
+        const Tree &get_tree() const {
+            return this->tree;
+        }
+
+        Snapshot snapshot() {
+            return this->tree.snapshot();
+        }
+
+        size_t size() const {
+            return this->tree.size();
+        }
+
+        // same as GeoTree::insert, an existing value keeps its attrs
+        bool insert(const T &value, float lon, float lat) {
+            assert(this->opened);
+            bool inserted = this->tree.insert(value, lon, lat);
+            Lock lock(this->mutex);
+            GeoByteWriter &out = this->begin_record(OP_PLACE, value);
+            out.put(lon);
+            out.put(lat);
+            this->end_record(lock);
+            return inserted;
+        }
+
+        bool insert(const T &value, float lon, float lat, uint32_t attrs) {
+            assert(this->opened);
+            bool inserted = this->tree.insert(value, lon, lat, attrs);
+            Lock lock(this->mutex);
+            GeoByteWriter &out = this->begin_record(OP_INSERT, value);
+            out.put(lon);
+            out.put(lat);
+            out.put(attrs);
+            this->end_record(lock);
+            return inserted;
+        }
+
+        bool insert(const Item &item) {
+            return this->insert(item.value, item.lon, item.lat);
+        }
+
+        bool move(const T &value, float lon, float lat) {
+            assert(this->opened);
+            if (!this->tree.move(value, lon, lat)) {
+                return false;
+            }
+            Lock lock(this->mutex);
+            GeoByteWriter &out = this->begin_record(OP_MOVE, value);
+            out.put(lon);
+            out.put(lat);
+            this->end_record(lock);
+            return true;
+        }
+
+        bool erase(const T &value) {
+            assert(this->opened);
+            if (!this->tree.erase(value)) {
+                return false;
+            }
+            Lock lock(this->mutex);
+            this->begin_record(OP_ERASE, value);
+            this->end_record(lock);
+            return true;
+        }
+
+        bool set_attrs(const T &value, uint32_t attrs) {
+            assert(this->opened);
+            if (!this->tree.set_attrs(value, attrs)) {
+                return false;
+            }
+            Lock lock(this->mutex);
+            GeoByteWriter &out = this->begin_record(OP_ATTRS, value);
+            out.put(attrs);
+            this->end_record(lock);
+            return true;
+        }
+
+        // wait until all records so far are written, and synced if options.fsync.
+        // concurrent callers share the same group. false after an io error of the log.
+        bool sync() {
+            Lock lock(this->mutex);
+            uint64_t target = this->appended;
+            this->syncers++;
+            this->wakeup.notify_all();
+            while (this->flushed < target && !this->failed) {
+                this->done.wait(lock);
+            }
+            this->syncers--;
+            return !this->failed;
+        }
+
+        // checkpoint now and wait for it, false on io error
+        bool checkpoint() {
+            assert(this->opened);
+            Lock lock(this->mutex);
+            while (this->ckpt_snapshot != NULL || this->ckpt_running) {
+                this->done.wait(lock);
+            }
+            this->start_checkpoint(lock);
+            uint64_t ticket = this->ckpt_done + 1;
+            while (this->ckpt_done < ticket) {
+                this->done.wait(lock);
+            }
+            return this->ckpt_ok;
+        }
+
+    private:
+        GeoLoggedTree(const GeoLoggedTree &);
+        GeoLoggedTree &operator=(const GeoLoggedTree &);
+
+        // covers the logs before gen
+        string ckpt_path(uint64_t gen) const {
+            return this->gen_path(".ckpt.", gen);
+        }
+
+        string log_path(uint64_t gen) const {
+            return this->gen_path(".log.", gen);
+        }
+
+        string gen_path(const char *kind, uint64_t gen) const {
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), "%s%llu", kind, (unsigned long long)gen);
+            return this->path + suffix;
+        }
+
+        bool list_logs(vector<uint64_t> &gens) const {
+            return this->list_gens(".log.", gens);
+        }
+
+        bool list_ckpts(vector<uint64_t> &gens) const {
+            return this->list_gens(".ckpt.", gens);
+        }
+
+        // gens of existing files of a kind in increasing order
+        bool list_gens(const char *kind, vector<uint64_t> &gens) const {
+            size_t slash = this->path.rfind('/');
+            string dir = slash == string::npos ? "." : this->path.substr(0, slash + 1);
+            string prefix = (slash == string::npos ? this->path : this->path.substr(slash + 1)) + kind;
+            DIR *dp = opendir(dir.c_str());
+            if (dp == NULL) {
+                return false;
+            }
+            while (struct dirent *ent = readdir(dp)) {
+                const char *name = ent->d_name;
+                if (strncmp(name, prefix.c_str(), prefix.size()) != 0) {
+                    continue;
+                }
+                const char *digits = name + prefix.size();
+                char *end = NULL;
+                uint64_t gen = strtoull(digits, &end, 10);
+                if (*digits >= '0' && *digits <= '9' && *end == '\0' && gen != 0) {
+                    gens.push_back(gen);
+                }
+            }
+            closedir(dp);
+            sort(gens.begin(), gens.end());
+            return true;
+        }
+
+        // apply groups of a log file up to the first bad one
+        int replay(uint64_t gen) {
+            vector<char> buf;
+            if (!geo_read_file(this->log_path(gen).c_str(), buf)) {
+                return REPLAY_BAD;
+            }
+            GeoByteReader reader(buf.data(), buf.data() + buf.size());
+            LogHeader header;
+            if (!reader.get(header) || header.magic != LOG_MAGIC || header.version != LOG_VERSION
+                || header.key_size != sizeof(T) || header.gen != gen)
+            {
+                return REPLAY_TORN;
+            }
+
+            while (reader.pos != reader.end) {
+                GroupHeader group;
+                if (!reader.get(group) || group.magic != GROUP_MAGIC
+                    || group.size > (uint64_t)(reader.end - reader.pos)
+                    || geo_checksum(reader.pos, group.size) != group.checksum)
+                {
+                    return REPLAY_TORN;
+                }
+                GeoByteReader records(reader.pos, reader.pos + group.size);
+                for (uint32_t i = 0; i < group.records; ++i) {
+                    if (!this->replay_record(records)) {
+                        return REPLAY_BAD;
+                    }
+                }
+                if (records.pos != records.end) {
+                    return REPLAY_BAD;
+                }
+                reader.pos = records.end;
+            }
+            return REPLAY_OK;
+        }
+
+        // replayed on the same state they were logged on, so each has the same effect
+        bool replay_record(GeoByteReader &reader) {
+            uint8_t op;
+            T value;
+            float lon, lat;
+            uint32_t attrs;
+            if (!reader.get(op) || !reader.get(value)) {
+                return false;
+            }
+            switch (op) {
+            case OP_INSERT:
+                if (!reader.get(lon) || !reader.get(lat) || !reader.get(attrs) || !Tree::is_valid(lon, lat)) {
+                    return false;
+                }
+                this->tree.insert(value, lon, lat, attrs);
+                return true;
+            case OP_PLACE:
+                if (!reader.get(lon) || !reader.get(lat) || !Tree::is_valid(lon, lat)) {
+                    return false;
+                }
+                this->tree.insert(value, lon, lat);
+                return true;
+            case OP_MOVE:
+                if (!reader.get(lon) || !reader.get(lat) || !Tree::is_valid(lon, lat)) {
+                    return false;
+                }
+                return this->tree.move(value, lon, lat);
+            case OP_ERASE:
+                return this->tree.erase(value);
+            case OP_ATTRS:
+                return reader.get(attrs) && this->tree.set_attrs(value, attrs);
+            default:
+                return false;
+            }
+        }
+
+        // op and value of a record into the current batch, under mutex
+        GeoByteWriter &begin_record(uint8_t op, const T &value) {
+            GeoByteWriter &out = this->pending.back().out;
+            this->record_begin = out.buf.size();
+            out.put(op);
+            out.put(value);
+            return out;
+        }
+
+        void end_record(Lock &lock) {
+            this->pending.back().records++;
+            this->appended++;
+            if (this->failed) {
+                // nothing will write it
+                this->pending.back() = Batch(this->gen);
+                this->pending_bytes = 0;
+                return;
+            }
+
+            bool first = this->pending_bytes == 0;
+            this->pending_bytes += this->pending.back().out.buf.size() - this->record_begin;
+            if (first || this->pending_bytes >= this->options.group_bytes) {
+                this->wakeup.notify_all();      // first record of a group, or a full group
+            }
+
+            this->since_ckpt++;
+            if (this->options.checkpoint_records != 0 && this->since_ckpt >= this->options.checkpoint_records
+                && this->ckpt_snapshot == NULL && !this->ckpt_running)
+            {
+                this->start_checkpoint(lock);
+            }
+        }
+
+        // new records go to a new log file, the snapshot covers all before it. under mutex
+        void start_checkpoint(Lock &lock) {
+            (void)lock;
+            this->gen++;
+            this->pending.push_back(Batch(this->gen));
+            this->ckpt_snapshot = new Snapshot(this->tree.snapshot());
+            this->ckpt_gen = this->gen;
+            this->since_ckpt = 0;
+            this->wakeup.notify_all();
+        }
+
+        bool is_urgent() const {
+            return this->stopping || this->syncers != 0 || this->pending_bytes >= this->options.group_bytes
+                || this->pending.size() > 1;
+        }
+
+        void flush_loop() {
+            Lock lock(this->mutex);
+            while (true) {
+                while (!this->has_pending() && !this->stopping) {
+                    this->wakeup.wait(lock);
+                }
+                if (!this->has_pending()) {
+                    break;
+                }
+
+                // group commit window
+                boost::system_time deadline = boost::get_system_time()
+                    + boost::posix_time::milliseconds(this->options.flush_ms);
+                while (!this->is_urgent() && this->wakeup.timed_wait(lock, deadline)) {
+                }
+
+                vector<Batch> batches;
+                batches.swap(this->pending);
+                this->pending.push_back(Batch(this->gen));
+                this->pending_bytes = 0;
+                lock.unlock();
+
+                bool ok = true;
+                uint64_t records = 0;
+                for (size_t i = 0; i < batches.size() && ok; ++i) {
+                    if (batches[i].records == 0 && i + 1 < batches.size()) {
+                        continue;   // no need for a file until the last
+                    }
+                    ok = this->write_batch(batches[i]);
+                    records += batches[i].records;
+                    lock.lock();
+                    this->file_gen = this->fd >= 0 ? batches[i].gen : 0;
+                    lock.unlock();
+                }
+                if (ok && this->options.fsync && this->fd >= 0) {
+                    ok = fdatasync(this->fd) == 0;
+                }
+
+                lock.lock();
+                this->flushed += records;
+                this->failed = this->failed || !ok;
+                this->done.notify_all();
+            }
+
+            if (this->fd >= 0) {
+                ::close(this->fd);
+                this->fd = -1;
+            }
+        }
+
+        bool has_pending() const {
+            return this->pending.size() > 1 || this->pending.back().records != 0;
+        }
+
+        // to the log file of the batch, the previous file is synced and closed on switching
+        bool write_batch(const Batch &batch) {
+            if (batch.gen != this->file_gen || this->fd < 0) {
+                if (this->fd >= 0) {
+                    bool ok = !this->options.fsync || fdatasync(this->fd) == 0;
+                    ::close(this->fd);
+                    this->fd = -1;
+                    if (!ok) {
+                        return false;
+                    }
+                }
+                this->fd = ::open(this->log_path(batch.gen).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+                if (this->fd < 0) {
+                    return false;
+                }
+                struct stat st;
+                if (fstat(this->fd, &st) != 0) {
+                    return false;
+                }
+                if (st.st_size == 0) {
+                    LogHeader header = {LOG_MAGIC, LOG_VERSION, sizeof(T), 0, batch.gen};
+                    if (!write_all(this->fd, reinterpret_cast<const char *>(&header), sizeof(header))) {
+                        return false;
+                    }
+                }
+            }
+            if (batch.records == 0) {
+                return true;
+            }
+
+            const vector<char> &buf = batch.out.buf;
+            GroupHeader group = {GROUP_MAGIC, (uint32_t)batch.records, buf.size(), geo_checksum(buf.data(), buf.size())};
+            GeoByteWriter out;
+            out.buf.reserve(sizeof(group) + buf.size());
+            out.put(group);
+            out.put_array(buf.data(), buf.size());
+            return write_all(this->fd, out.buf.data(), out.buf.size());
+        }
+
+        static bool write_all(int fd, const char *data, size_t size) {
+            while (size != 0) {
+                ssize_t n = ::write(fd, data, size);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                } else if (n <= 0) {
+                    return false;
+                }
+                data += n;
+                size -= n;
+            }
+            return true;
+        }
+
+        void checkpoint_loop() {
+            Lock lock(this->mutex);
+            while (true) {
+                while (this->ckpt_snapshot == NULL && !this->stopping) {
+                    this->wakeup.wait(lock);
+                }
+                if (this->ckpt_snapshot == NULL) {
+                    break;
+                }
+
+                Snapshot *snap = this->ckpt_snapshot;
+                uint64_t gen = this->ckpt_gen;
+                this->ckpt_snapshot = NULL;
+                this->ckpt_running = true;
+                lock.unlock();
+
+                // durable once saved, so the logs it covers may go
+                string ckpt = this->ckpt_path(gen);
+                bool ok = snap->save(ckpt.c_str());
+                delete snap;    // its nodes are freed by the next write of the tree
+
+                lock.lock();
+                // the flusher is done with older files once it opens the new one
+                while (ok && this->file_gen < gen && !this->failed) {
+                    this->done.wait(lock);
+                }
+                ok = ok && !this->failed;
+                if (ok) {
+                    uint64_t first = this->first_gen;
+                    this->first_gen = gen;
+                    lock.unlock();
+                    for (; first < gen; ++first) {
+                        remove(this->log_path(first).c_str());
+                    }
+                    vector<uint64_t> ckpts;
+                    this->list_ckpts(ckpts);
+                    for (size_t i = 0; i < ckpts.size() && ckpts[i] < gen; ++i) {
+                        remove(this->ckpt_path(ckpts[i]).c_str());
+                    }
+                    lock.lock();
+                }
+                this->ckpt_running = false;
+                this->ckpt_ok = ok;
+                this->ckpt_done++;
+                this->done.notify_all();
+            }
+        }
+    };
+
+}   // namespace geotools
@@ -1,6 +1,15 @@
 #pragma once
 
 #include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+// runtime dispatched simd kernels, gcc/clang vector extensions on x86
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define GEOTOOLS_SIMD_DISPATCH 1
+#endif
 
 
 namespace geotools {
@@ -33,8 +42,250 @@ namespace geotools {
             asin(sqrt(u * u + cos(lat1r) * cos(lat2r) * v * v));
     }
 
+    // point on the unit sphere, squared chord length between two points is monotonic with geo_distance
+    inline void geo_to_xyz(double lond, double latd, double &x, double &y, double &z) {
+        double lonr = deg2rad(lond);
+        double latr = deg2rad(latd);
+        x = cos(latr) * cos(lonr);
+        y = cos(latr) * sin(lonr);
+        z = sin(latr);
+    }
+
+    // shortest distance from (lon, lat) to the meridian segment at mlon between lat_s and lat_n
+    inline double geo_distance_to_meridian(
+        double lond, double latd, double mlond, double lat_sd, double lat_nd)
+    {
+        double dlon = fabs(fmod(lond - mlond, 360.0));
+        if (dlon > 180.0) {
+            dlon = 360.0 - dlon;
+        }
+
+        if (dlon < 90.0) {
+            // foot of the perpendicular from the point to the meridian great circle
+            double latr = deg2rad(latd);
+            double dlonr = deg2rad(dlon);
+            double footd = atan2(sin(latr), cos(latr) * cos(dlonr)) / M_PI * 180.0;
+            if (lat_sd <= footd && footd <= lat_nd) {
+                return EARTH_RADIUS_IN_METERS * asin(cos(latr) * sin(dlonr));
+            }
+        }
+
+        // distance along the meridian is unimodal, the nearest point is an endpoint
+        return std::min(
+            geo_distance(lond, latd, mlond, lat_sd), geo_distance(lond, latd, mlond, lat_nd));
+    }
+
     inline int32_t geo_round(double flt) {
         return ceil(flt - 0.5);
     }
 
+
+    typedef void (*GeoDistanceBatchFunc)(
+        double lon, double lat, const float *lons, const float *lats, size_t size, uint32_t *dists);
+
+    inline void geo_distance_batch_scalar(
+        double lon, double lat, const float *lons, const float *lats, size_t size, uint32_t *dists)
+    {
+        for (size_t i = 0; i < size; ++i) {
+            dists[i] = geo_round(geo_distance(lons[i], lats[i], lon, lat));
+        }
+    }
+
+#ifdef GEOTOOLS_SIMD_DISPATCH
+    // gcc vector types of LANES doubles
+    template<int LANES> struct GeoSimdTypes;
+
+#define GEOTOOLS_SIMD_TYPES(lanes) \
+    template<> struct GeoSimdTypes<lanes> { \
+        typedef double V __attribute__((vector_size(lanes * 8))); \
+        typedef long long VI __attribute__((vector_size(lanes * 8))); \
+        typedef float VF __attribute__((vector_size(lanes * 4))); \
+        typedef int32_t VI32 __attribute__((vector_size(lanes * 4))); \
+        static inline __attribute__((always_inline)) void convert(const VF &from, V &to) { \
+            to = __builtin_convertvector(from, V); \
+        } \
+        static inline __attribute__((always_inline)) void convert(const V &from, VI32 &to) { \
+            to = __builtin_convertvector(from, VI32); \
+        } \
+    };
+
+    GEOTOOLS_SIMD_TYPES(4)
+    GEOTOOLS_SIMD_TYPES(8)
+#undef GEOTOOLS_SIMD_TYPES
+
+    // haversine over LANES doubles with polynomial sin, cos and asin, error is below 1e-5 meters.
+    // vectors are passed by reference to keep the non-inlined abi independent of the isa.
+    template<int LANES>
+    struct GeoDistanceKernel {
+        typedef GeoSimdTypes<LANES> Types;
+        typedef typename Types::V V;
+        typedef typename Types::VI VI;
+        typedef typename Types::VF VF;
+        typedef typename Types::VI32 VI32;
+
+        // x = mask ? a : x
+        static inline __attribute__((always_inline)) void select(V &x, const VI &mask, const V &a) {
+            x = (V)((mask & (VI)a) | (~mask & (VI)x));
+        }
+
+        static inline __attribute__((always_inline)) void horner(
+            const V &x, const double *coefs, size_t size, V &p)
+        {
+            p = x * 0 + coefs[size - 1];
+#pragma GCC unroll 32
+            for (size_t i = size - 1; i > 0; --i) {
+                p = p * x + coefs[i - 1];
+            }
+        }
+
+        // |x| <= pi / 2
+        static inline __attribute__((always_inline)) void sin_poly(const V &x, V &out) {
+            static const double coefs[] = {
+                1.0, -1.0 / 6, 1.0 / 120, -1.0 / 5040, 1.0 / 362880, -1.0 / 39916800,
+                1.0 / 6227020800.0, -1.0 / 1307674368000.0, 1.0 / 355687428096000.0,
+            };
+            horner(x * x, coefs, sizeof(coefs) / sizeof(coefs[0]), out);
+            out *= x;
+        }
+
+        // |x| <= pi / 2
+        static inline __attribute__((always_inline)) void cos_poly(const V &x, V &out) {
+            static const double coefs[] = {
+                1.0, -1.0 / 2, 1.0 / 24, -1.0 / 720, 1.0 / 40320, -1.0 / 3628800,
+                1.0 / 479001600, -1.0 / 87178291200.0, 1.0 / 20922789888000.0,
+                -1.0 / 6402373705728000.0,
+            };
+            horner(x * x, coefs, sizeof(coefs) / sizeof(coefs[0]), out);
+        }
+
+        // 0 <= x <= 0.5, taylor series of asin
+        static inline __attribute__((always_inline)) void asin_poly(const V &x, V &out) {
+            static const double coefs[] = {
+                1.0, 1.0 / 6, 3.0 / 40, 5.0 / 112, 35.0 / 1152, 63.0 / 2816,
+                231.0 / 13312, 143.0 / 10240, 6435.0 / 557056, 12155.0 / 1245184,
+                46189.0 / 5505024, 88179.0 / 12058624, 676039.0 / 104857600,
+                1300075.0 / 226492416, 5014575.0 / 973078528, 9694845.0 / 2080374784,
+                100180065.0 / 23622320128.0, 116680311.0 / 30064771072.0,
+            };
+            horner(x * x, coefs, sizeof(coefs) / sizeof(coefs[0]), out);
+            out *= x;
+        }
+
+        // x >= 0, newton iterations of inverse square root
+        static inline __attribute__((always_inline)) void sqrt_nr(const V &x, V &out) {
+            VI magic = {};
+            magic += 0x5FE6EB50C7B537A9LL;
+            V y = (V)(magic - ((VI)x >> 1));
+            for (int i = 0; i < 4; ++i) {
+                y = y * (1.5 - 0.5 * x * y * y);
+            }
+            out = x * y;
+        }
+
+        static inline __attribute__((always_inline)) void distance(
+            const V &lons, const V &lats, double lon, double lat, double coslat, V &out)
+        {
+            const double half_rad = M_PI / 360.0;
+            V u, v, c;
+            sin_poly((lats - lat) * half_rad, u);
+            // sin^2 is symmetric around pi/2
+            V dlon = (lons - lon) * half_rad;
+            select(dlon, dlon < 0, -dlon);
+            select(dlon, dlon > M_PI / 2, M_PI - dlon);
+            sin_poly(dlon, v);
+            cos_poly(lats * (M_PI / 180.0), c);
+
+            V h = u * u + coslat * c * v * v;
+            select(h, h > 1.0, h * 0 + 1.0);
+
+            // asin(s) = pi / 2 - 2 * asin(sqrt((1 - s) / 2)) for s > 0.5
+            V s, t, a;
+            sqrt_nr(h, s);
+            VI big = s > 0.5;
+            sqrt_nr((1.0 - s) * 0.5, t);
+            select(t, ~big, s);
+            asin_poly(t, a);
+            select(a, big, M_PI / 2 - 2.0 * a);
+            out = 2.0 * EARTH_RADIUS_IN_METERS * a;
+        }
+
+        static inline __attribute__((always_inline)) void block(
+            const float *lons, const float *lats, double lon, double lat, double coslat, uint32_t *dists)
+        {
+            VF flons, flats;
+            memcpy(&flons, lons, sizeof(flons));
+            memcpy(&flats, lats, sizeof(flats));
+
+            V dlons, dlats, d;
+            Types::convert(flons, dlons);
+            Types::convert(flats, dlats);
+            distance(dlons, dlats, lon, lat, coslat, d);
+
+            // same as geo_round() for d >= 0
+            VI32 rounded;
+            Types::convert(d + 0.5, rounded);
+            memcpy(dists, &rounded, sizeof(rounded));
+        }
+
+        static inline __attribute__((always_inline)) void run(
+            double lon, double lat, const float *lons, const float *lats, size_t size, uint32_t *dists)
+        {
+            double coslat = cos(deg2rad(lat));
+            size_t i = 0;
+            for (; i + LANES <= size; i += LANES) {
+                block(lons + i, lats + i, lon, lat, coslat, dists + i);
+            }
+
+            if (i < size) {
+                // pad the tail with the query point
+                float tail_lons[LANES];
+                float tail_lats[LANES];
+                uint32_t tail_dists[LANES];
+                for (size_t k = 0; k < (size_t)LANES; ++k) {
+                    tail_lons[k] = i + k < size ? lons[i + k] : lon;
+                    tail_lats[k] = i + k < size ? lats[i + k] : lat;
+                }
+                block(tail_lons, tail_lats, lon, lat, coslat, tail_dists);
+                memcpy(dists + i, tail_dists, (size - i) * sizeof(uint32_t));
+            }
+        }
+    };
+
+    __attribute__((target("avx2,fma")))
+    inline void geo_distance_batch_avx2(
+        double lon, double lat, const float *lons, const float *lats, size_t size, uint32_t *dists)
+    {
+        GeoDistanceKernel<4>::run(lon, lat, lons, lats, size, dists);
+    }
+
+    __attribute__((target("avx512f")))
+    inline void geo_distance_batch_avx512(
+        double lon, double lat, const float *lons, const float *lats, size_t size, uint32_t *dists)
+    {
+        GeoDistanceKernel<8>::run(lon, lat, lons, lats, size, dists);
+    }
+#endif
+
+    inline GeoDistanceBatchFunc geo_distance_batch_select() {
+#ifdef GEOTOOLS_SIMD_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return geo_distance_batch_avx512;
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return geo_distance_batch_avx2;
+        }
+#endif
+        return geo_distance_batch_scalar;
+    }
+
+    // dists[i] = geo_round(geo_distance(lons[i], lats[i], lon, lat)), with the best kernel of this cpu.
+    // 2 lanes of sse2 are slower than libm, so cpus without avx2 use the scalar loop.
+    inline void geo_distance_batch(
+        double lon, double lat, const float *lons, const float *lats, size_t size, uint32_t *dists)
+    {
+        static const GeoDistanceBatchFunc func = geo_distance_batch_select();
+        func(lon, lat, lons, lats, size, dists);
+    }
+
 }
@@ -10,6 +10,8 @@
 #include <stdint.h>
 #include <getopt.h>
 #include <sys/time.h>
+#include <thread>
+#include <atomic>
 
 #include <boost/algorithm/string/replace.hpp>
 
@@ -18,6 +20,11 @@
 
 #include "string_fmt.hpp"
 #include "../geotree.hpp"
+#include "../geomorton.hpp"
+#include "../geotree_concurrent.hpp"
+#include "../geotree_sharded.hpp"
+#include "../geotree_frozen.hpp"
+#include "../geotree_wal.hpp"
 #include "../geodensity_bounded.hpp"
 
 
@@ -95,7 +102,7 @@ void log(const string &prefix, const string &fmt, va_list va) {
 }
 
 
-void info(string fmt, ...) {
+void info(const char *fmt, ...) {
     va_list va;
     va_start(va, fmt);
     log("INFO: ", fmt, va);
@@ -103,7 +110,7 @@ void info(string fmt, ...) {
 }
 
 
-void err(string fmt, ...) {
+void err(const char *fmt, ...) {
     va_list va;
     va_start(va, fmt);
     log("ERR:  ", fmt, va);
@@ -205,7 +212,7 @@ struct DurationLogger {
 
     template <class ...Args>
     DurationLogger(const string &fmt, Args && ...args)
-        : start(Time::Now()), msg(strfmt(fmt, std::forward<Args>(args)...)), reqs(0)
+        : start(Time::Now()), msg(strfmt(fmt.c_str(), std::forward<Args>(args)...)), reqs(0)
     {
          info("[begin] %s", this->msg.c_str());
     };
@@ -261,16 +268,44 @@ void bench_geo_density(
     info("GeoDensity stats after set: [nearbys:%zu][set_count:%zu] %s", nearbys, set_count, den.stats.repr().c_str());
 
     vector<tuple<int32_t, int32_t, uint32_t>> lon_lat_radius;
-    for (size_t i = 0; i < query_count; ++i) {
-        const Entry &e = entries[i * 2 + 1];
-        if (!tree.is_valid(e.lon, e.lat)) {
-            continue;
+    {
+        DurationLogger dl("GeoTree.get_nearby_radius_by_count [nearbys:%zu][query_count:%zu]", nearbys, query_count);
+        dl.set_reqs(query_count);
+
+        for (size_t i = 0; i < query_count; ++i) {
+            const Entry &e = entries[i * 2 + 1];
+            if (!tree.is_valid(e.lon, e.lat)) {
+                continue;
+            }
+
+            uint32_t radius = tree.get_nearby_radius_by_count(e.lon, e.lat, nearbys);
+            if (radius != 0) {
+                lon_lat_radius.push_back(make_tuple(e.lon, e.lat, radius));
+            }
         }
+    }
 
-        uint32_t radius = tree.get_nearby_radius_by_count(e.lon, e.lat, nearbys);
-        if (radius != 0) {
-            lon_lat_radius.push_back(make_tuple(e.lon, e.lat, radius));
+    // the same radiuses through get_nearby, as it was done before
+    {
+        DurationLogger dl("GeoTree.get_nearby.back [nearbys:%zu][query_count:%zu]", nearbys, query_count);
+        dl.set_reqs(query_count);
+
+        size_t mismatch = 0;
+        size_t idx = 0;
+        for (size_t i = 0; i < query_count; ++i) {
+            const Entry &e = entries[i * 2 + 1];
+            if (!tree.is_valid(e.lon, e.lat)) {
+                continue;
+            }
+
+            vector<Tree::Item> items = tree.get_nearby(e.lon, e.lat, nearbys);
+            uint32_t radius = items.empty() ? 0 : items.back().dist;
+            if (radius != 0) {
+                mismatch += radius != get<2>(lon_lat_radius[idx++]);
+            }
         }
+        assert(mismatch == 0);
+        (void)mismatch;
     }
 
 
@@ -317,6 +352,78 @@ void bench_geo_density(
 }
 
 
+void bench_estimate_radius(const vector<Entry> &entries, Tree &tree, size_t nearbys, size_t query_count) {
+    vector<const Entry *> points;
+    vector<uint32_t> exacts;
+    for (size_t i = 0; i < query_count; ++i) {
+        const Entry &e = entries[i * 2 + 1];
+        if (!tree.is_valid(e.lon, e.lat)) {
+            continue;
+        }
+
+        uint32_t radius = tree.get_nearby_radius_by_count(e.lon, e.lat, nearbys);
+        if (radius != 0) {
+            points.push_back(&e);
+            exacts.push_back(radius);
+        }
+    }
+
+    vector<uint32_t> ests(points.size());
+    {
+        DurationLogger dl("GeoTree.estimate_radius_by_count [nearbys:%zu][query_count:%zu]", nearbys, points.size());
+        dl.set_reqs(points.size());
+
+        for (size_t i = 0; i < points.size(); ++i) {
+            ests[i] = tree.estimate_radius_by_count(points[i]->lon, points[i]->lat, nearbys);
+        }
+    }
+
+    size_t within = 0;
+    double avg_var = 0;
+    for (size_t i = 0; i < points.size(); ++i) {
+        double var = abs(log2(std::max<uint32_t>(ests[i], 1) / (double)exacts[i]));
+        avg_var = (i * avg_var + var) / (i + 1);
+        within += var <= log2(1.1);
+    }
+    info("GeoTree.estimate_radius_by_count stats: [nearbys:%zu][query_count:%zu][avg_var:%f][within_10%%:%f]",
+        nearbys, points.size(), avg_var, (double)within / std::max<size_t>(points.size(), 1));
+}
+
+
+// readers run nearby queries while one writer keeps moving points
+template<class Query, class Move>
+void bench_readers(const vector<Entry> &entries, size_t threads, size_t queries, Query query, Move move) {
+    atomic<bool> stop(false);
+    size_t moves = 0;
+    thread writer([&]() {
+        for (size_t i = 0; !stop; i = (i + 1) % entries.size(), ++moves) {
+            const Entry &e = entries[i];
+            move(e.uid, std::min(LON_MAX, e.lon + 0.00003f), e.lat);
+        }
+    });
+
+    {
+        DurationLogger dl("%zu reader threads, %zu queries each", threads, queries);
+        dl.set_reqs(threads * queries);
+        vector<thread> readers;
+        for (size_t t = 0; t < threads; ++t) {
+            readers.push_back(thread([&, t]() {
+                for (size_t i = 0; i < queries; ++i) {
+                    const Entry &e = entries[(t * queries + i) % entries.size()];
+                    query(e.lon, e.lat);
+                }
+            }));
+        }
+        for (thread &r : readers) {
+            r.join();
+        }
+    }
+    stop = true;
+    writer.join();
+    info("writer moved %zu entries meanwhile", moves);
+}
+
+
 Tree *g_tree = NULL;
 
 TEST_CASE("verify") {
@@ -367,6 +474,104 @@ int main(int argc, char **argv) {
         }
     }
 
+    // bulk loading
+    if (args.tests.count("bulk")) {
+        vector<Tree::Item> items;
+        items.reserve(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const Entry &e = entries[i];
+            if (tree.is_valid(e.lon, e.lat)) {
+                items.push_back(Tree::Item(e.uid, e.lon, e.lat));
+            }
+        }
+
+        Tree bulk(args.split);
+        {
+            DurationLogger dl("bulk loading %zu entries. [split:%u]", items.size(), args.split);
+            dl.set_reqs(items.size());
+            bulk.bulk_load(items.begin(), items.end());
+        }
+        info("bulk loaded %zu unique entries of %zu input", bulk.size(), items.size());
+    }
+
+    // binary snapshot, compare with inserting above
+    if (args.tests.count("save")) {
+        const char *path = "bench_query.save";
+        {
+            DurationLogger dl("saving %zu entries. [split:%u]", tree.size(), args.split);
+            dl.set_reqs(tree.size());
+            bool ok = tree.save(path);
+            assert(ok);
+            (void)ok;
+        }
+
+        Tree loaded;
+        {
+            DurationLogger dl("loading %zu entries. [split:%u]", tree.size(), args.split);
+            dl.set_reqs(tree.size());
+            bool ok = loaded.load(path);
+            assert(ok);
+            (void)ok;
+        }
+        info("loaded %zu entries", loaded.size());
+        remove(path);
+    }
+
+    // inserting with the write-ahead log, compare with inserting above
+    if (args.tests.count("wal")) {
+        const char *path = "bench_query.wal";
+        GeoLoggedTree<uint32_t> logged(args.split);
+        bool ok = logged.open(path);
+        assert(ok);
+        {
+            DurationLogger dl("inserting %zu entries with log. [split:%u]", entries.size(), args.split);
+            dl.set_reqs(entries.size());
+            for (size_t i = 0; i < entries.size(); ++i) {
+                const Entry &e = entries[i];
+                if (logged.get_tree().is_valid(e.lon, e.lat)) {
+                    logged.insert(e.uid, e.lon, e.lat);
+                }
+            }
+        }
+        {
+            DurationLogger dl("syncing log of %zu entries", logged.size());
+            ok = logged.sync();
+            assert(ok);
+        }
+        logged.close();
+
+        GeoLoggedTree<uint32_t> recovered(args.split);
+        {
+            DurationLogger dl("recovering %zu entries from log. [split:%u]", logged.size(), args.split);
+            dl.set_reqs(logged.size());
+            ok = recovered.open(path);
+            assert(ok);
+        }
+        info("recovered %zu entries", recovered.size());
+        recovered.close();
+        (void)ok;
+
+        for (int gen = 1; gen < 100; ++gen) {
+            remove(strfmt("%s.log.%d", path, gen).c_str());
+            remove(strfmt("%s.ckpt.%d", path, gen).c_str());
+        }
+    }
+
+    // small moves, mostly within the same leaf
+    if (args.tests.count("move")) {
+        DurationLogger dl("moving %zu entries by a few meters. [split:%u]", entries.size(), args.split);
+        dl.set_reqs(entries.size());
+
+        for (size_t i = 0; i < entries.size(); ++i) {
+            Entry &e = entries[i];
+            if (!tree.is_valid(e.lon, e.lat)) {
+                continue;
+            }
+            e.lon = std::min(LON_MAX, e.lon + 0.00003f);
+            tree.move(e.uid, e.lon, e.lat);
+        }
+    }
+
     const size_t QUERY_RUN = 10000;
     vector<size_t> nearby_counts = {1, 10, 50, 100, 200, 500, 1000};
 
@@ -386,10 +591,269 @@ int main(int argc, char **argv) {
         }
     }
 
+    // lazy nearest first, reading as many as "knn" asks for
+    if (args.tests.count("iter")) {
+        for (size_t nearbys : nearby_counts) {
+            DurationLogger dl(
+                "running %zu nearest iterations of %zu items. [split:%u]", QUERY_RUN, nearbys, args.split);
+            dl.set_reqs(QUERY_RUN);
+
+            for (size_t i = 0; i < QUERY_RUN; ++i) {
+                Entry &e = entries[i];
+                Tree::NearestIterator it = tree.iter_nearest(e.lon, e.lat);
+                Tree::Item item;
+                size_t read = 0;
+                while (read < nearbys && it.next(item)) {
+                    read++;
+                }
+                assert(read == nearbys);
+            }
+        }
+    }
+
+    // frozen copy of the tree, queried on the mapped file
+    if (args.tests.count("frozen")) {
+        const char *path = "bench_query.frozen";
+        {
+            DurationLogger dl("writing frozen tree of %zu entries. [split:%u]", tree.size(), args.split);
+            dl.set_reqs(tree.size());
+            bool ok = GeoFrozenTree<uint32_t>::write(tree, path);
+            assert(ok);
+            (void)ok;
+        }
+
+        GeoFrozenTree<uint32_t> frozen;
+        {
+            DurationLogger dl("opening frozen tree");
+            bool ok = frozen.open(path);
+            assert(ok);
+            (void)ok;
+        }
+
+        for (size_t nearbys : nearby_counts) {
+            {
+                DurationLogger dl("running %zu nearest queries of %zu on tree. [split:%u]", QUERY_RUN, nearbys, args.split);
+                dl.set_reqs(QUERY_RUN);
+                for (size_t i = 0; i < QUERY_RUN; ++i) {
+                    Entry &e = entries[i];
+                    vector<Tree::Item> nearby = tree.get_nearest(e.lon, e.lat, nearbys, option);
+                    assert(nearby.size() == nearbys);
+                }
+            }
+            {
+                DurationLogger dl("running %zu nearest queries of %zu on frozen. [split:%u]", QUERY_RUN, nearbys, args.split);
+                dl.set_reqs(QUERY_RUN);
+                for (size_t i = 0; i < QUERY_RUN; ++i) {
+                    Entry &e = entries[i];
+                    vector<Tree::Item> nearby = frozen.get_nearest(e.lon, e.lat, nearbys, option);
+                    assert(nearby.size() == nearbys);
+                }
+            }
+        }
+        remove(path);
+    }
+
+    // same queries as "tree" with a reused scratch
+    if (args.tests.count("scratch")) {
+        Tree::NearbyScratch scratch;
+        for (size_t nearbys : nearby_counts) {
+            DurationLogger dl(
+                "running %zu queries for nearby %zu with scratch. [split:%u][opt:%u]",
+                QUERY_RUN, nearbys, args.split, option);
+            dl.set_reqs(QUERY_RUN);
+
+            for (size_t i = 0; i < QUERY_RUN; ++i) {
+                Entry &e = entries[i];
+                Tree::ItemRange nearby = tree.get_nearby(e.lon, e.lat, nearbys, scratch, option);
+                assert(nearby.size() == nearbys);
+            }
+        }
+    }
+
+    // same queries as "tree" in one batch
+    if (args.tests.count("batch")) {
+        vector<GeoLonLat> points;
+        for (size_t i = 0; i < QUERY_RUN; ++i) {
+            points.push_back(GeoLonLat(entries[i].lon, entries[i].lat));
+        }
+
+        GeoWorkerPool pool(4);
+        for (size_t threads : {1, 4}) {
+            for (size_t nearbys : nearby_counts) {
+                vector<Tree::Item> out(QUERY_RUN * nearbys);
+                vector<size_t> sizes(QUERY_RUN);
+                DurationLogger dl(
+                    "running batch of %zu queries for nearby %zu. [split:%u][opt:%u][threads:%zu]",
+                    QUERY_RUN, nearbys, args.split, option, threads);
+                dl.set_reqs(QUERY_RUN);
+                tree.get_nearby_batch(points.data(), points.size(), nearbys, out.data(), sizes.data(), option,
+                    threads == 1 ? NULL : &pool);
+            }
+        }
+    }
+
+    // best-first k nearest
+    if (args.tests.count("knn")) {
+        for (size_t nearbys : nearby_counts) {
+            DurationLogger dl(
+                "running %zu knn queries for nearest %zu. [split:%u][opt:%u]",
+                QUERY_RUN, nearbys, args.split, option);
+            dl.set_reqs(QUERY_RUN);
+
+            for (size_t i = 0; i < QUERY_RUN; ++i) {
+                Entry &e = entries[i];
+                vector<Tree::Item> nearest = tree.get_nearest(e.lon, e.lat, nearbys, option);
+                assert(nearest.size() == nearbys);
+            }
+        }
+    }
+
+    // morton code linear quadtree, same queries as "tree"
+    if (args.tests.count("morton")) {
+        vector<Tree::Item> items;
+        items.reserve(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const Entry &e = entries[i];
+            if (tree.is_valid(e.lon, e.lat)) {
+                items.push_back(Tree::Item(e.uid, e.lon, e.lat));
+            }
+        }
+
+        GeoMortonTree<uint32_t> morton;
+        {
+            DurationLogger dl("morton bulk loading %zu entries.", items.size());
+            dl.set_reqs(items.size());
+            morton.bulk_load(items.begin(), items.end());
+        }
+
+        for (size_t nearbys : nearby_counts) {
+            DurationLogger dl("running %zu morton queries for nearby %zu. [opt:%u]", QUERY_RUN, nearbys, option);
+            dl.set_reqs(QUERY_RUN);
+
+            for (size_t i = 0; i < QUERY_RUN; ++i) {
+                Entry &e = entries[i];
+                vector<Tree::Item> nearby = morton.get_nearby(e.lon, e.lat, nearbys, option);
+                assert(nearby.size() == nearbys);
+            }
+        }
+
+        // with a tombstone in the sorted array
+        morton.erase(items[0].value);
+        for (size_t nearbys : nearby_counts) {
+            DurationLogger dl("running %zu morton queries for nearby %zu after an erase. [opt:%u]", QUERY_RUN, nearbys, option);
+            dl.set_reqs(QUERY_RUN);
+
+            for (size_t i = 0; i < QUERY_RUN; ++i) {
+                Entry &e = entries[i];
+                vector<Tree::Item> nearby = morton.get_nearby(e.lon, e.lat, nearbys, option);
+                assert(nearby.size() == nearbys);
+            }
+        }
+
+        // with sqrt(n) points moved into the pending buffer, just below its merge limit
+        size_t moved = std::min<size_t>(std::max(256.0, sqrt(double(items.size()))), items.size()) - 1;
+        for (size_t i = 1; i <= moved && i < items.size(); ++i) {
+            const Tree::Item &item = items[i];
+            morton.insert(item.value, item.lon, std::min(LAT_MAX, item.lat + 0.00003f));
+        }
+        for (size_t nearbys : nearby_counts) {
+            DurationLogger dl("running %zu morton queries for nearby %zu with %zu pending. [opt:%u]",
+                QUERY_RUN, nearbys, moved, option);
+            dl.set_reqs(QUERY_RUN);
+
+            for (size_t i = 0; i < QUERY_RUN; ++i) {
+                Entry &e = entries[i];
+                vector<Tree::Item> nearby = morton.get_nearby(e.lon, e.lat, nearbys, option);
+                assert(nearby.size() == nearbys);
+            }
+        }
+    }
+
+    // lock free readers vs a mutex around GeoTree
+    if (args.tests.count("concurrent")) {
+        vector<Tree::Item> items;
+        items.reserve(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const Entry &e = entries[i];
+            if (tree.is_valid(e.lon, e.lat)) {
+                items.push_back(Tree::Item(e.uid, e.lon, e.lat));
+            }
+        }
+        vector<Entry> valid;
+        for (const Tree::Item &item : items) {
+            valid.push_back(Entry{item.value, item.lon, item.lat});
+        }
+
+        const size_t nearbys = 50;
+        ConcurrentGeoTree<uint32_t> ctree(args.split);
+        ctree.bulk_load(items.begin(), items.end());
+        boost::mutex mutex;
+        for (size_t threads : {1, 2, 4, 8}) {
+            info("mutex GeoTree, nearby %zu [split:%u]", nearbys, args.split);
+            bench_readers(valid, threads, QUERY_RUN,
+                [&](float lon, float lat) {
+                    boost::mutex::scoped_lock sl(mutex);
+                    tree.get_nearby(lon, lat, nearbys, option);
+                },
+                [&](uint32_t uid, float lon, float lat) {
+                    boost::mutex::scoped_lock sl(mutex);
+                    tree.move(uid, lon, lat);
+                });
+
+            info("ConcurrentGeoTree, nearby %zu [split:%u]", nearbys, args.split);
+            bench_readers(valid, threads, QUERY_RUN,
+                [&](float lon, float lat) { ctree.get_nearby(lon, lat, nearbys, option); },
+                [&](uint32_t uid, float lon, float lat) { ctree.move(uid, lon, lat); });
+        }
+    }
+
+    // parallel writers on a sharded tree, then the "tree" query mix
+    if (args.tests.count("sharded")) {
+        for (size_t threads : {1, 4}) {
+            ShardedGeoTree<uint32_t> stree(args.split);
+            {
+                DurationLogger dl("sharded inserting %zu entries by %zu threads. [split:%u][shards:%zu]",
+                    entries.size(), threads, args.split, stree.shard_count());
+                dl.set_reqs(entries.size());
+                vector<thread> writers;
+                for (size_t t = 0; t < threads; ++t) {
+                    writers.push_back(thread([&, t]() {
+                        for (size_t i = t; i < entries.size(); i += threads) {
+                            const Entry &e = entries[i];
+                            if (stree.is_valid(e.lon, e.lat)) {
+                                stree.insert(e.uid, e.lon, e.lat);
+                            }
+                        }
+                    }));
+                }
+                for (thread &w : writers) {
+                    w.join();
+                }
+            }
+            info("sharded inserted %zu unique entries", stree.size());
+
+            if (threads != 1) {
+                continue;
+            }
+            for (size_t nearbys : nearby_counts) {
+                DurationLogger dl("running %zu sharded queries for nearest %zu. [split:%u]",
+                    QUERY_RUN, nearbys, args.split);
+                dl.set_reqs(QUERY_RUN);
+
+                for (size_t i = 0; i < QUERY_RUN; ++i) {
+                    Entry &e = entries[i];
+                    vector<Tree::Item> nearby = stree.get_nearest(e.lon, e.lat, nearbys);
+                    assert(nearby.size() == nearbys);
+                }
+            }
+        }
+    }
+
     // geodensity
     if (args.tests.count("density")) {
         for (size_t nearbys : nearby_counts) {
             bench_geo_density(entries, tree, nearbys, 10000, 10000);
+            bench_estimate_radius(entries, tree, nearbys, 10000);
         }
     }
 
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <cstdlib>
+
+#include "../geotree.hpp"
+
+
+// random data shared by the tests, items have int values
+
+inline float rand_range(float lo, float hi) {
+    return lo + (hi - lo) * (rand() / (float)RAND_MAX);
+}
+
+
+// size items around (lon, lat), valued by their index
+inline std::vector<geotools::GeoItem<int> > rand_items(size_t size, float lon, float lat, float span) {
+    using namespace geotools;
+    std::vector<GeoItem<int> > items;
+    for (size_t i = 0; i < size; ++i) {
+        float ilon = std::max(LON_MIN, std::min(LON_MAX, rand_range(lon - span, lon + span)));
+        float ilat = std::max(LAT_MIN, std::min(LAT_MAX, rand_range(lat - span, lat + span)));
+        items.push_back(GeoItem<int>(i, ilon, ilat));
+    }
+    return items;
+}
+
+
+template<class T>
+std::vector<uint32_t> dists_of(const std::vector<geotools::GeoItem<T> > &items) {
+    std::vector<uint32_t> dists;
+    for (size_t i = 0; i < items.size(); ++i) {
+        dists.push_back(items[i].dist);
+    }
+    return dists;
+}
@@ -19,7 +19,10 @@ inline std::string vstrfmt(const std::string &fmt_str, va_list ap) {
     while(true) {
         buffer.resize(n, '\0');
         strcpy(const_cast<char *>(buffer.c_str()), fmt_str.c_str());
-        final_n = vsnprintf(const_cast<char *>(buffer.c_str()), n, fmt_str.c_str(), ap);
+        va_list aq;
+        va_copy(aq, ap);
+        final_n = vsnprintf(const_cast<char *>(buffer.c_str()), n, fmt_str.c_str(), aq);
+        va_end(aq);
         if (final_n < 0 || final_n >= (int)n) {
             n += abs(final_n - (int)n + 1);
         } else {
@@ -30,7 +33,7 @@ inline std::string vstrfmt(const std::string &fmt_str, va_list ap) {
 }
 
 
-inline std::string strfmt(const std::string fmt_str, ...)
+inline std::string strfmt(const char *fmt_str, ...)
 {
     va_list ap;
     va_start(ap, fmt_str);
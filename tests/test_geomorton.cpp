@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <vector>
+#include <cstdlib>
+
+#include "catch.h"
+
+#define private public
+#include "../geomorton.hpp"
+#include "geo_test_util.hpp"
+
+
+using namespace std;
+using namespace geotools;
+
+
+typedef int T;
+typedef GeoMortonTree<T> Tree;
+
+
+static vector<uint32_t> sorted_dists(const vector<Tree::Item> &items, float lon, float lat) {
+    vector<uint32_t> dists;
+    for (size_t i = 0; i < items.size(); ++i) {
+        dists.push_back(geo_round(geo_distance(lon, lat, items[i].lon, items[i].lat)));
+    }
+    sort(dists.begin(), dists.end());
+    return dists;
+}
+
+
+TEST_CASE("morton.code") {
+    // top bit pair is (lat, lon), same quadrants as GeoBox
+    CHECK(Tree::morton_code(GeoLonLat(-90, -45)) >> 62 == 0);  // SW
+    CHECK(Tree::morton_code(GeoLonLat(90, -45)) >> 62 == 1);   // SE
+    CHECK(Tree::morton_code(GeoLonLat(-90, 45)) >> 62 == 2);   // NW
+    CHECK(Tree::morton_code(GeoLonLat(90, 45)) >> 62 == 3);    // NE
+
+    CHECK(Tree::morton_code(GeoLonLat(LON_MIN, LAT_MIN)) == 0);
+    CHECK(Tree::morton_code(GeoLonLat(LON_MAX, LAT_MAX)) == ~uint64_t(0));
+
+    pair<uint64_t, uint64_t> range = Tree::cell_range(1, 0, 1);
+    CHECK(range.first == 1ULL << 62);
+    CHECK(range.second == (2ULL << 62) - 1);
+}
+
+
+TEST_CASE("morton.nearby") {
+    srand(11);
+    vector<Tree::Item> data = rand_items(3000, 116, 40, 1);
+    vector<Tree::Item> far = rand_items(100, 0, 0, 180);
+    data.insert(data.end(), far.begin(), far.end());
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i].value = i;
+    }
+
+    Tree tree;
+    for (size_t i = 0; i < data.size(); ++i) {
+        CHECK(tree.insert(data[i]));
+    }
+    tree.verify();
+    REQUIRE(tree.size() == data.size());
+
+    Tree loaded;
+    loaded.bulk_load(data.begin(), data.end());
+    loaded.verify();
+    REQUIRE(loaded.size() == data.size());
+
+    size_t counts[] = {0, 1, 7, 100, 1000, 5000};
+    for (size_t round = 0; round < 20; ++round) {
+        float lon = round < 10 ? rand_range(115, 117) : rand_range(-180, 180);
+        float lat = round < 10 ? rand_range(39, 41) : rand_range(-85, 85);
+        vector<uint32_t> all = sorted_dists(data, lon, lat);
+
+        for (size_t k = 0; k < sizeof(counts) / sizeof(counts[0]); ++k) {
+            size_t count = counts[k];
+            CAPTURE(lon);
+            CAPTURE(lat);
+            CAPTURE(count);
+
+            vector<Tree::Item> got = tree.get_nearby(lon, lat, count);
+            REQUIRE(got.size() == std::min(count, data.size()));
+            CHECK(dists_of(got) == sorted_dists(got, lon, lat));
+            CHECK(dists_of(loaded.get_nearby(lon, lat, count)) == dists_of(got));
+            // never closer than the exact answer
+            for (size_t i = 0; i < got.size(); ++i) {
+                CHECK(got[i].dist >= all[i]);
+            }
+            if (count >= data.size()) {
+                CHECK(dists_of(got) == all);
+            }
+
+            vector<Tree::Item> unsorted = tree.get_nearby(lon, lat, count, GEO_NO_SORT);
+            sort(unsorted.begin(), unsorted.end());
+            CHECK(dists_of(unsorted) == dists_of(got));
+        }
+    }
+}
+
+
+TEST_CASE("morton.erase") {
+    srand(12);
+    vector<Tree::Item> data = rand_items(5000, 116, 40, 1);
+    Tree tree;
+    tree.bulk_load(data.begin(), data.end());
+
+    // move half of them, erase a quarter, both in sorted and pending entries
+    for (size_t i = 0; i < data.size(); i += 2) {
+        data[i].lon = rand_range(115, 117);
+        data[i].lat = rand_range(39, 41);
+        CHECK(!tree.insert(data[i]));
+    }
+    tree.verify();
+    vector<Tree::Item> rest;
+    for (size_t i = 0; i < data.size(); ++i) {
+        if (i % 4 == 1 || i % 4 == 2) {
+            CHECK(tree.erase(data[i].value));
+        } else {
+            rest.push_back(data[i]);
+        }
+    }
+    CHECK(!tree.erase(data[1].value));
+    tree.verify();
+    REQUIRE(tree.size() == rest.size());
+
+    Tree expect;
+    expect.bulk_load(rest.begin(), rest.end());
+    for (size_t round = 0; round < 20; ++round) {
+        float lon = rand_range(115, 117);
+        float lat = rand_range(39, 41);
+        size_t count = 1 + rand() % 500;
+        CHECK(dists_of(tree.get_nearby(lon, lat, count)) == dists_of(expect.get_nearby(lon, lat, count)));
+    }
+
+    // tombstones left in sorted entries are counted by the cells
+    tree.bulk_load(rest.begin(), rest.end());
+    for (size_t i = 0; i < rest.size() / 10; ++i) {
+        CHECK(tree.erase(rest[i].value));
+    }
+    tree.verify();
+    REQUIRE(tree.dead_count == rest.size() / 10);
+    vector<Tree::Item> live(rest.begin() + rest.size() / 10, rest.end());
+    expect.bulk_load(live.begin(), live.end());
+    for (size_t round = 0; round < 20; ++round) {
+        float lon = rand_range(115, 117);
+        float lat = rand_range(39, 41);
+        size_t count = 1 + rand() % 500;
+        CHECK(dists_of(tree.get_nearby(lon, lat, count)) == dists_of(expect.get_nearby(lon, lat, count)));
+    }
+    rest.swap(live);
+
+    for (size_t i = 0; i < rest.size(); ++i) {
+        CHECK(tree.erase(rest[i].value));
+    }
+    tree.verify();
+    CHECK(tree.size() == 0);
+    CHECK(tree.get_nearby(116, 40, 10).empty());
+}
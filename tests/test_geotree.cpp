@@ -1,6 +1,7 @@
 #include <algorithm>
 #include <vector>
 #include <iostream>
+#include <cstdlib>
 
 #include <boost/shared_ptr.hpp>
 #include <boost/assign/list_of.hpp>
@@ -8,6 +9,7 @@
 
 #define private public
 #include "../geotree.hpp"
+#include "geo_test_util.hpp"
 
 
 using namespace std;
@@ -20,6 +22,7 @@ using boost::assign::list_of;
 typedef int T;
 typedef GeoNode<T> Node;
 typedef GeoTree<T> Tree;
+typedef GeoTree<T, GeoNodePool<T, true> > AttrTree;
 
 
 namespace std {
@@ -62,16 +65,10 @@ void verify_shape(Node *input, Node *expect) {
     if (input->type == GEONODE_LEAF) {
         REQUIRE(input->values.size() == expect->values.size());
 
-        vector<T> vals;
-        for (auto in = input->values.begin(); in != input->values.end(); ++in) {
-            vals.push_back(in->first);
-        }
+        vector<T> vals = input->values.keys;
         sort(vals.begin(), vals.end());
 
-        vector<T> exvals;
-        for (auto ex = expect->values.begin(); ex != expect->values.end(); ++ex) {
-            exvals.push_back(ex->first);
-        }
+        vector<T> exvals = expect->values.keys;
         sort(exvals.begin(), exvals.end());
 
         CHECK(vals == exvals);
@@ -144,6 +141,81 @@ TEST_CASE("basic.write") {
 }
 
 
+TEST_CASE("leaf") {
+    Node leaf(GEONODE_LEAF);
+    CHECK(leaf.add(1, GeoLonLat(1, 10)));
+    CHECK(leaf.add(2, GeoLonLat(2, 20)));
+    CHECK(leaf.add(3, GeoLonLat(3, 30)));
+    CHECK(!leaf.add(2, GeoLonLat(4, 40)));
+    CHECK(leaf.count == 3);
+
+    // swap with last
+    leaf.must_remove(1);
+    CHECK(leaf.count == 2);
+    CHECK(leaf.values.keys == list_of(3)(2).convert_to_container<vector<T>>());
+    CHECK(leaf.values.lonlat(0) == GeoLonLat(3, 30));
+    CHECK(leaf.values.lonlat(1) == GeoLonLat(2, 20));
+
+    leaf.must_remove(2);
+    leaf.must_remove(3);
+    CHECK(leaf.count == 0);
+    CHECK(leaf.values.size() == 0);
+    CHECK(leaf.values.find(3) == 0);
+}
+
+
+// leaf of a chain of single child nodes
+static const Node *only_leaf(const Node *node) {
+    while (!node->is_leaf()) {
+        node = node->SW != NULL ? node->SW : node->NW != NULL ? node->NW : node->NE != NULL ? node->NE : node->SE;
+    }
+    return node;
+}
+
+
+TEST_CASE("leaf.index") {
+    // a pile of points on one spot stays a single leaf at max_depth
+    const size_t size = 3 * Node::LeafType::INDEX_SIZE;
+    Tree tree(8);
+    for (size_t i = 0; i < size; ++i) {
+        CHECK(tree.insert(i, 116, 40));
+    }
+    const Node *leaf = only_leaf(tree.root);
+    CHECK(leaf->count == size);
+    CHECK(leaf->values.index != NULL);
+    tree.verify();
+
+    // slots follow swaps with last
+    srand(9);
+    for (size_t round = 0; round < size; ++round) {
+        T value = rand() % size;
+        switch (round % 3) {
+        case 0:
+            tree.erase(value);
+            break;
+        case 1:
+            tree.move(value, 116, 40);
+            break;
+        default:
+            tree.insert(value, 116, 40);
+            break;
+        }
+    }
+    tree.verify();
+
+    // dropped once small
+    for (size_t i = 0; i < size; ++i) {
+        if (i % 16 != 0) {
+            tree.erase(i);
+        }
+    }
+    tree.verify();
+    CHECK(tree.size() <= size / 16);
+    CHECK(only_leaf(tree.root)->count == tree.size());
+    CHECK(only_leaf(tree.root)->values.index == NULL);
+}
+
+
 void sort_by_dist(vector<Tree::Item> &items, float lon, float lat) {
     for (size_t i = 0; i < items.size(); ++i) {
         Tree::Item &item = items[i];
@@ -221,3 +293,1206 @@ TEST_CASE("basic.read") {
 
 
 // TODO: stress test
+
+
+TEST_CASE("box.min_distance") {
+    srand(1);
+    for (size_t round = 0; round < 200; ++round) {
+        float w = rand_range(-180, 170);
+        float s = rand_range(-85, 75);
+        GeoBox box(w, w + rand_range(0, 10), s + rand_range(0, 10), s);
+        GeoLonLat lonlat(rand_range(-180, 180), rand_range(-85, 85));
+
+        double lower = box.min_distance(lonlat);
+        double nearest = DBL_MAX;
+        for (int i = 0; i <= 50; ++i) {
+            for (int j = 0; j <= 50; ++j) {
+                float lon = box.W + (box.E - box.W) * i / 50;
+                float lat = box.S + (box.N - box.S) * j / 50;
+                nearest = std::min(nearest, geo_distance(lon, lat, lonlat.lon, lonlat.lat));
+            }
+        }
+        CAPTURE(lonlat.lon);
+        CAPTURE(lonlat.lat);
+        CHECK(lower <= nearest * (1 + 1e-7) + 1e-3);  // float sampling error
+        CHECK(lower >= nearest * 0.99 - 1e-3);
+    }
+
+    GeoBox box(10, 20, 40, 30);
+    CHECK(box.min_distance(GeoLonLat(15, 35)) == 0);
+    CHECK(box.min_distance(GeoLonLat(15, 45)) == Approx(geo_distance(15, 45, 15, 40)));
+}
+
+
+TEST_CASE("nearest") {
+    srand(2);
+    vector<Tree::Item> data = rand_items(2000, 116, 40, 2);
+    vector<Tree::Item> far = rand_items(50, 0, 0, 180);
+    data.insert(data.end(), far.begin(), far.end());
+
+    Tree tree(8);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i].value = i;
+        tree.insert(data[i]);
+    }
+
+    vector<size_t> counts = list_of(0)(1)(7)(100)(1000)(3000);
+    for (size_t round = 0; round < 20; ++round) {
+        float lon = round < 10 ? rand_range(114, 118) : rand_range(-180, 180);
+        float lat = round < 10 ? rand_range(38, 42) : rand_range(-85, 85);
+        vector<Tree::Item> sorted = data;
+        sort_by_dist(sorted, lon, lat);
+
+        for (size_t count : counts) {
+            vector<Tree::Item> got = tree.get_nearest(lon, lat, count);
+            vector<Tree::Item> expect(sorted.begin(), sorted.begin() + std::min(count, sorted.size()));
+            CAPTURE(lon);
+            CAPTURE(lat);
+            CAPTURE(count);
+            REQUIRE(got.size() == expect.size());
+            CHECK(dists_of(got) == dists_of(expect));
+
+            got = tree.get_nearest(lon, lat, count, GEO_NO_SORT);
+            sort(got.begin(), got.end());
+            CHECK(dists_of(got) == dists_of(expect));
+        }
+    }
+}
+
+
+TEST_CASE("box.max_distance") {
+    srand(3);
+    for (size_t round = 0; round < 200; ++round) {
+        float w = rand_range(-180, 170);
+        float s = rand_range(-85, 75);
+        GeoBox box(w, w + rand_range(0, 10), s + rand_range(0, 10), s);
+        GeoLonLat lonlat(rand_range(-180, 180), rand_range(-85, 85));
+
+        double upper = box.max_distance(lonlat);
+        double farthest = 0;
+        for (int i = 0; i <= 50; ++i) {
+            for (int j = 0; j <= 50; ++j) {
+                float lon = box.W + (box.E - box.W) * i / 50;
+                float lat = box.S + (box.N - box.S) * j / 50;
+                farthest = std::max(farthest, geo_distance(lon, lat, lonlat.lon, lonlat.lat));
+            }
+        }
+        CAPTURE(lonlat.lon);
+        CAPTURE(lonlat.lat);
+        CHECK(upper * (1 + 1e-7) + 1e-3 >= farthest);   // float sampling error
+    }
+
+    GeoBox box(10, 20, 40, 30);
+    CHECK(box.max_distance(GeoLonLat(-165, -35)) == Approx(M_PI * EARTH_RADIUS_IN_METERS));
+    CHECK(box.max_distance(GeoLonLat(15, 30)) == Approx(geo_distance(15, 30, 10, 40)));
+}
+
+
+vector<T> values_of(const vector<Tree::Item> &items) {
+    vector<T> values;
+    for (size_t i = 0; i < items.size(); ++i) {
+        values.push_back(items[i].value);
+    }
+    sort(values.begin(), values.end());
+    return values;
+}
+
+
+TEST_CASE("within_radius") {
+    srand(4);
+    vector<Tree::Item> data = rand_items(3000, 116, 40, 1);
+
+    Tree tree(8);
+    for (size_t i = 0; i < data.size(); ++i) {
+        tree.insert(data[i]);
+    }
+
+    vector<uint32_t> radiuses = list_of(0)(100)(1000)(10000)(50000)(200000)(20000000);
+    for (size_t round = 0; round < 10; ++round) {
+        float lon = rand_range(115, 117);
+        float lat = rand_range(39, 41);
+        vector<Tree::Item> sorted = data;
+        sort_by_dist(sorted, lon, lat);
+
+        for (uint32_t meters : radiuses) {
+            vector<Tree::Item> expect;
+            for (size_t i = 0; i < sorted.size() && sorted[i].dist <= meters; ++i) {
+                expect.push_back(sorted[i]);
+            }
+
+            CAPTURE(lon);
+            CAPTURE(lat);
+            CAPTURE(meters);
+            vector<Tree::Item> got = tree.get_within_radius(lon, lat, meters);
+            REQUIRE(got.size() == expect.size());
+            CHECK(dists_of(got) == dists_of(expect));
+            CHECK(values_of(got) == values_of(expect));
+
+            got = tree.get_within_radius(lon, lat, meters, GEO_NO_DIST);
+            CHECK(values_of(got) == values_of(expect));
+            for (size_t i = 0; i < got.size(); ++i) {
+                CHECK(got[i].dist == 0);
+            }
+
+            // capped
+            got = tree.get_within_radius(lon, lat, meters, GEO_OPT_NONE, 10);
+            CHECK(got.size() == std::min<size_t>(10, expect.size()));
+            for (size_t i = 0; i < got.size(); ++i) {
+                CHECK(got[i].dist <= meters);
+            }
+        }
+    }
+
+    Tree empty;
+    CHECK(empty.get_within_radius(1, 2, 1000).empty());
+}
+
+
+struct BoxCollector {
+    vector<T> values;
+
+    void operator()(const T &value, float lon, float lat) {
+        (void)lon;
+        (void)lat;
+        this->values.push_back(value);
+    }
+};
+
+
+TEST_CASE("box") {
+    srand(5);
+    vector<Tree::Item> data = rand_items(3000, 116, 40, 1);
+
+    Tree tree(8);
+    for (size_t i = 0; i < data.size(); ++i) {
+        tree.insert(data[i]);
+    }
+
+    vector<GeoBox> boxes = list_of
+        (GeoBox())
+        (GeoBox(116, 116, 40, 40))
+        (GeoBox(0, 10, 10, 0))
+        (GeoBox(116, 117, 41, 40));
+    for (size_t round = 0; round < 20; ++round) {
+        float w = rand_range(114, 117);
+        float s = rand_range(38, 41);
+        boxes.push_back(GeoBox(w, w + rand_range(0, 2), s + rand_range(0, 2), s));
+    }
+
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        const GeoBox &box = boxes[i];
+        vector<T> expect;
+        for (size_t j = 0; j < data.size(); ++j) {
+            if (box.contains(GeoLonLat(data[j].lon, data[j].lat))) {
+                expect.push_back(data[j].value);
+            }
+        }
+
+        CAPTURE(i);
+        CHECK(tree.count_in_box(box) == expect.size());
+
+        vector<T> got = tree.query_box(box, BoxCollector()).values;
+        sort(got.begin(), got.end());
+        CHECK(got == expect);
+    }
+
+    CHECK(tree.count_in_box(GeoBox()) == tree.size());
+    Tree empty;
+    CHECK(empty.count_in_box(GeoBox()) == 0);
+}
+
+
+TEST_CASE("fixed") {
+    srand(26);
+    vector<GeoLonLat> points = list_of
+        (GeoLonLat(LON_MIN, LAT_MIN))
+        (GeoLonLat(LON_MAX, LAT_MAX))
+        (GeoLonLat(LON_MIN, LAT_MAX))
+        (GeoLonLat(0, 0))
+        (GeoLonLat(-1e-30, -1e-30));
+    for (size_t round = 0; round < 2000; ++round) {
+        GeoLonLat lonlat(rand_range(LON_MIN, LON_MAX), rand_range(LAT_MIN, LAT_MAX));
+        points.push_back(lonlat);
+        // on the center of a cell, which goes to the north east
+        GeoBox box = GeoFixed(lonlat).box(1 + rand() % 17);
+        points.push_back(GeoLonLat((box.W + box.E) / 2.0, (box.N + box.S) / 2.0));
+    }
+
+    Tree tree;
+    for (size_t i = 0; i < points.size(); ++i) {
+        GeoLonLat lonlat = points[i];
+        CAPTURE(lonlat.lon);
+        CAPTURE(lonlat.lat);
+        GeoFixed fixed(lonlat);
+        // rounded down to the cell boundary
+        CHECK(GeoFixed::from_fixed(fixed.x, LON_MIN, LON_MAX) <= lonlat.lon);
+        CHECK(GeoFixed::from_fixed(fixed.y, LAT_MIN, LAT_MAX) <= lonlat.lat);
+        if (fixed.x != 0xFFFFFFFFu) {
+            CHECK(lonlat.lon < GeoFixed::from_fixed(fixed.x + 1ULL, LON_MIN, LON_MAX));
+        }
+        if (fixed.y != 0xFFFFFFFFu) {
+            CHECK(lonlat.lat < GeoFixed::from_fixed(fixed.y + 1ULL, LAT_MIN, LAT_MAX));
+        }
+
+        // same path as float boxes while they are exact
+        GeoBox box;
+        uint64_t code = 0;
+        for (uint32_t depth = 0; depth < 17; ++depth) {
+            CHECK(fixed.dir(depth) == box.locate(lonlat));
+            int dir = box.locate_and_move(lonlat);
+            GeoBox cell = fixed.box(depth + 1);
+            CHECK((cell.W == box.W && cell.E == box.E && cell.N == box.N && cell.S == box.S));
+            if (depth < tree.max_depth) {
+                code = (code << 2) | (dir == D_NW ? 0 : dir == D_NE ? 1 : dir == D_SE ? 2 : 3);
+            }
+        }
+        CHECK(tree.quad_code(lonlat) == code);
+        CHECK(fixed.common_depth(fixed) == 32);
+    }
+
+    CHECK(GeoFixed(GeoLonLat(-0.001, 1)).common_depth(GeoFixed(GeoLonLat(0.001, 1))) == 0);
+    // both in the east half, split by the meridian of 90
+    CHECK(GeoFixed(GeoLonLat(90.001, 1)).common_depth(GeoFixed(GeoLonLat(89.999, 1))) == 1);
+}
+
+
+TEST_CASE("select_by_proxy") {
+    srand(6);
+    // dense points with duplicates, ranking errors of float unit vectors matter here
+    vector<Tree::Item> data = rand_items(3000, 116.3, 39.9, 0.002);
+    for (size_t i = 0; i < 100; ++i) {
+        data.push_back(Tree::Item(data.size(), data[i].lon, data[i].lat));
+    }
+
+    vector<Node *> nodes(4, (Node *)NULL);
+    for (size_t i = 0; i < data.size(); ++i) {
+        Node *&node = nodes[i % nodes.size()];
+        if (node == NULL) {
+            node = new Node(GEONODE_LEAF);
+        }
+        node->must_add(data[i].value, GeoLonLat(data[i].lon, data[i].lat));
+    }
+    Tree::NearbyScratch scratch;
+    scratch.leaves.assign(nodes.begin(), nodes.end());
+
+    vector<size_t> counts = list_of(1)(2)(10)(500)(3099)(3100)(5000);
+    for (size_t round = 0; round < 20; ++round) {
+        GeoLonLat lonlat = round == 0
+            ? GeoLonLat(data[0].lon, data[0].lat)
+            : GeoLonLat(rand_range(116.29, 116.31), rand_range(39.89, 39.91));
+        vector<Tree::Item> sorted = data;
+        sort_by_dist(sorted, lonlat.lon, lonlat.lat);
+
+        scratch.proxies.resize(data.size());
+        Tree::measure_proxy(scratch.leaves, lonlat, scratch.proxies.data());
+        for (size_t count : counts) {
+            Tree::select_by_proxy(scratch, lonlat, count);
+            vector<Tree::Item> got = scratch.ans;
+            sort(got.begin(), got.end());
+            vector<Tree::Item> expect(sorted.begin(), sorted.begin() + std::min(count, sorted.size()));
+            CAPTURE(round);
+            CAPTURE(count);
+            CHECK(dists_of(got) == dists_of(expect));
+        }
+    }
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        delete nodes[i];
+    }
+}
+
+
+TEST_CASE("pool") {
+    GeoNodePool<T, false, 4> pool;
+    vector<Node *> nodes;
+    for (size_t i = 0; i < 10; ++i) {
+        nodes.push_back(pool.alloc(GEONODE_LEAF));
+        nodes.back()->must_add(i, GeoLonLat(i, i));
+    }
+    CHECK(pool.slabs.size() == 3);
+    // contiguous in slab
+    CHECK(nodes[1] == nodes[0] + 1);
+
+    // recycled
+    pool.free(nodes[5]);
+    CHECK(nodes[5]->type == GEONODE_FREE);
+    pool.free(nodes[2]);
+    CHECK(pool.alloc(GEONODE_INNER) == nodes[2]);
+    Node *node = pool.alloc(GEONODE_LEAF);
+    CHECK(node == nodes[5]);
+    CHECK(node->count == 0);
+    CHECK(node->values.size() == 0);
+    CHECK(pool.alloc(GEONODE_LEAF) == nodes[9] + 1);
+    CHECK(pool.slabs.size() == 3);
+
+    pool.clear(NULL);
+    CHECK(pool.slabs.empty());
+    CHECK(pool.alloc(GEONODE_LEAF) != NULL);
+}
+
+
+TEST_CASE("heap_alloc") {
+    srand(7);
+    vector<Tree::Item> data = rand_items(1000, 116, 40, 1);
+
+    typedef GeoTree<T, GeoNodeHeapAlloc<T> > HeapTree;
+    HeapTree heap_tree(4);
+    Tree pool_tree(4);
+    for (size_t i = 0; i < data.size(); ++i) {
+        heap_tree.insert(data[i].value, data[i].lon, data[i].lat);
+        pool_tree.insert(data[i]);
+    }
+    for (size_t i = 0; i < data.size(); i += 2) {
+        heap_tree.erase(data[i].value);
+        pool_tree.erase(data[i].value);
+    }
+    heap_tree.verify();
+    pool_tree.verify();
+    vector<HeapTree::Item> got = heap_tree.get_nearby(116, 40, 100);
+    vector<Tree::Item> expect = pool_tree.get_nearby(116, 40, 100);
+    REQUIRE(got.size() == expect.size());
+    for (size_t i = 0; i < got.size(); ++i) {
+        CHECK(got[i].dist == expect[i].dist);
+    }
+}
+
+
+TEST_CASE("attrs.optional") {
+    const char *path = "test_geotree.save";
+    srand(8);
+    vector<Tree::Item> data = rand_items(3000, 116, 40, 1);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i].value = i;
+    }
+
+    // attrs are kept only on request
+    CHECK(sizeof(GeoLeafArray<T>) < sizeof(GeoLeafArray<T, true>));
+    Tree tree(8);
+    AttrTree attr_tree(8);
+    for (size_t i = 0; i < data.size(); ++i) {
+        CHECK(tree.insert(data[i]));
+        attr_tree.insert(data[i]);
+    }
+    for (size_t i = 0; i < data.size(); i += 3) {
+        float lon = rand_range(115, 117);
+        float lat = rand_range(39, 41);
+        CHECK(tree.move(data[i].value, lon, lat));
+        CHECK(tree.erase(data[i + 1].value));
+        attr_tree.move(data[i].value, lon, lat);
+        attr_tree.erase(data[i + 1].value);
+    }
+    tree.verify();
+    REQUIRE(tree.get_all() == attr_tree.get_all());
+    for (size_t round = 0; round < 10; ++round) {
+        float lon = rand_range(115, 117);
+        float lat = rand_range(39, 41);
+        CHECK(dists_of(tree.get_nearest(lon, lat, 50)) == dists_of(attr_tree.get_nearest(lon, lat, 50)));
+        uint32_t meters = rand() % 20000;
+        CHECK(dists_of(tree.get_within_radius(lon, lat, meters)) == dists_of(attr_tree.get_within_radius(lon, lat, meters)));
+    }
+
+    // same file format, attrs are 0
+    REQUIRE(tree.save(path));
+    AttrTree loaded;
+    REQUIRE(loaded.load(path));
+    CHECK(loaded.get_all() == attr_tree.get_all());
+    CHECK(loaded.get_nearest_by_attrs(116, 40, 1, 1).empty());
+    REQUIRE(attr_tree.save(path));
+    Tree plain_loaded;
+    REQUIRE(plain_loaded.load(path));
+    plain_loaded.verify();
+    CHECK(plain_loaded.get_all() == attr_tree.get_all());
+
+    // attrs would be lost, the file passes its checksum so the tree is left empty
+    attr_tree.set_attrs(data[2].value, 1);
+    REQUIRE(attr_tree.save(path));
+    CHECK(!plain_loaded.load(path));
+    CHECK(plain_loaded.size() == 0);
+    remove(path);
+}
+
+
+TEST_CASE("move") {
+    Tree tree(3);
+    CHECK(!tree.move(123, 10, 20));
+    CHECK(tree.size() == 0);
+
+    tree.insert(123, -10, 20);
+    tree.insert(124, 10, 20);
+    tree.insert(125, 10, -20);
+    tree.insert(126, -10, -20);
+    verify_tree(tree, I(L(list_of(123)), L(list_of(124)), L(list_of(125)), L(list_of(126))));
+
+    // same leaf, in place
+    Node *leaf = tree.root->NW;
+    CHECK(tree.move(123, -11, 21));
+    CHECK(tree.root->NW == leaf);
+    CHECK(leaf->values.lonlat(0) == GeoLonLat(-11, 21));
+    verify_tree(tree, I(L(list_of(123)), L(list_of(124)), L(list_of(125)), L(list_of(126))));
+
+    // another sub-tree
+    CHECK(tree.move(123, 11, 21));
+    verify_tree(tree, I(NULL, L(list_of(123)(124)), L(list_of(125)), L(list_of(126))));
+    CHECK(tree.get_nearby(11, 21, 1)[0].value == 123);
+
+    // random moves
+    srand(8);
+    vector<Tree::Item> data = rand_items(2000, 116, 40, 1);
+    Tree big(8);
+    for (size_t i = 0; i < data.size(); ++i) {
+        big.insert(data[i]);
+    }
+    for (size_t round = 0; round < 5000; ++round) {
+        Tree::Item &item = data[rand() % data.size()];
+        float span = round % 2 ? 0.0001 : 1;
+        item.lon = std::max(115.0f, std::min(117.0f, item.lon + rand_range(-span, span)));
+        item.lat = std::max(39.0f, std::min(41.0f, item.lat + rand_range(-span, span)));
+        CHECK(big.move(item.value, item.lon, item.lat));
+    }
+    big.verify();
+    CHECK(big.size() == data.size());
+
+    vector<Tree::Item> sorted = data;
+    sort_by_dist(sorted, 116, 40);
+    sorted.resize(100);
+    CHECK(dists_of(big.get_nearest(116, 40, 100)) == dists_of(sorted));
+}
+
+
+template<class N>
+size_t count_nodes(const N *node) {
+    if (node == NULL) {
+        return 0;
+    }
+    return 1 + count_nodes(node->NW) + count_nodes(node->NE) + count_nodes(node->SE) + count_nodes(node->SW);
+}
+
+
+TEST_CASE("merge") {
+    Tree tree(3);
+    CHECK(tree.get_merge_threshold() == 1);
+    tree.insert(123, -10, 20);
+    tree.insert(124, 10, 20);
+    tree.insert(125, 10, -20);
+    tree.insert(126, -10, -20);
+    verify_tree(tree, I(L(list_of(123)), L(list_of(124)), L(list_of(125)), L(list_of(126))));
+
+    CHECK(tree.erase(124));
+    CHECK(tree.erase(125));
+    verify_tree(tree, I(L(list_of(123)), NULL, NULL, L(list_of(126))));
+    // merged into a leaf
+    CHECK(tree.erase(126));
+    verify_tree(tree, L(list_of(123)));
+
+    tree.set_merge_threshold(0);
+    tree.insert(124, 10, 20);
+    tree.insert(125, 10, -20);
+    tree.insert(126, -10, -20);
+    CHECK(tree.erase(124));
+    CHECK(tree.erase(125));
+    CHECK(tree.erase(126));
+    verify_tree(tree, I(L(list_of(123)), NULL, NULL, NULL));
+
+    // churn
+    srand(9);
+    vector<Tree::Item> data = rand_items(5000, 116, 40, 1);
+    Tree big(16);
+    for (size_t i = 0; i < data.size(); ++i) {
+        big.insert(data[i]);
+    }
+    size_t full_nodes = count_nodes(big.root);
+    for (size_t i = 0; i < data.size(); ++i) {
+        if (i % 50 != 0) {
+            big.erase(data[i].value);
+        }
+    }
+    big.verify();
+    CHECK(big.size() == 100);
+    CHECK(count_nodes(big.root) * 10 < full_nodes);
+    CHECK(big.get_nearest(116, 40, 100).size() == 100);
+}
+
+
+bool same_shape(const Node *a, const Node *b) {
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    if (a->type != b->type || a->count != b->count) {
+        return false;
+    }
+    if (a->is_leaf()) {
+        vector<T> akeys = a->values.keys;
+        vector<T> bkeys = b->values.keys;
+        sort(akeys.begin(), akeys.end());
+        sort(bkeys.begin(), bkeys.end());
+        return akeys == bkeys;
+    }
+    return same_shape(a->NW, b->NW) && same_shape(a->NE, b->NE)
+        && same_shape(a->SE, b->SE) && same_shape(a->SW, b->SW);
+}
+
+
+TEST_CASE("bulk_load") {
+    srand(10);
+    vector<Tree::Item> data = rand_items(5000, 116, 40, 1);
+    vector<Tree::Item> far = rand_items(100, 0, 0, 180);
+    data.insert(data.end(), far.begin(), far.end());
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i].value = i;
+    }
+    // duplicated points and values, the later one wins
+    data.push_back(Tree::Item(5200, data[0].lon, data[0].lat));
+    data.push_back(Tree::Item(3, 10, 10));
+
+    Tree expect(8);
+    for (size_t i = 0; i < data.size(); ++i) {
+        expect.insert(data[i]);
+    }
+
+    Tree tree(8);
+    tree.insert(99999, 1, 1);   // replaced
+    tree.bulk_load(data.begin(), data.end());
+    tree.verify();
+    CHECK(tree.size() == expect.size());
+    CHECK(tree.get_all() == expect.get_all());
+    CHECK(same_shape(tree.root, expect.root));
+
+    // still writable
+    CHECK(tree.erase(3));
+    CHECK(tree.insert(3, 116, 40));
+    tree.verify();
+
+    tree.bulk_load(data.begin(), data.begin());
+    CHECK(tree.size() == 0);
+    CHECK(tree.root == NULL);
+}
+
+
+TEST_CASE("nearby_batch") {
+    srand(16);
+    vector<Tree::Item> data = rand_items(5000, 116, 40, 1);
+    vector<Tree::Item> far = rand_items(100, 0, 0, 180);
+    data.insert(data.end(), far.begin(), far.end());
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i].value = i;
+    }
+    Tree tree(8);
+    tree.bulk_load(data.begin(), data.end());
+
+    // clustered queries with duplicates, and some far away
+    vector<GeoLonLat> points;
+    for (size_t i = 0; i < 300; ++i) {
+        points.push_back(GeoLonLat(rand_range(115.9, 116.1), rand_range(39.9, 40.1)));
+    }
+    points.push_back(points[0]);
+    for (size_t i = 0; i < 20; ++i) {
+        points.push_back(GeoLonLat(rand_range(-180, 180), rand_range(-85, 85)));
+    }
+
+    // the same pool for all batches
+    GeoWorkerPool pool(3);
+    vector<size_t> counts = list_of(0)(1)(10)(100)(6000);
+    for (size_t count : counts) {
+        for (size_t threads = 1; threads <= 3; threads += 2) {
+            vector<Tree::Item> out(points.size() * count);
+            vector<size_t> sizes(points.size(), 12345);
+            tree.get_nearby_batch(points.data(), points.size(), count, out.data(), sizes.data(), GEO_OPT_NONE,
+                threads == 1 ? NULL : &pool);
+            for (size_t i = 0; i < points.size(); ++i) {
+                vector<Tree::Item> expect = tree.get_nearby(points[i].lon, points[i].lat, count);
+                CAPTURE(count);
+                CAPTURE(i);
+                REQUIRE(sizes[i] == expect.size());
+                vector<Tree::Item> got(out.begin() + i * count, out.begin() + i * count + sizes[i]);
+                CHECK(dists_of(got) == dists_of(expect));
+            }
+        }
+    }
+
+    Tree empty;
+    vector<size_t> sizes(points.size(), 12345);
+    empty.get_nearby_batch(points.data(), points.size(), 10, NULL, sizes.data());
+    CHECK(sizes == vector<size_t>(points.size(), 0));
+}
+
+
+TEST_CASE("nearby_scratch") {
+    srand(17);
+    vector<Tree::Item> data = rand_items(5000, 116, 40, 1);
+    Tree tree(8);
+    tree.bulk_load(data.begin(), data.end());
+
+    vector<GeoLonLat> points;
+    for (size_t i = 0; i < 100; ++i) {
+        points.push_back(GeoLonLat(rand_range(115.5, 116.5), rand_range(39.5, 40.5)));
+    }
+
+    Tree::NearbyScratch scratch;
+    vector<size_t> counts = list_of(0)(1)(10)(100)(6000);
+    for (size_t count : counts) {
+        for (size_t i = 0; i < points.size(); ++i) {
+            vector<Tree::Item> expect = tree.get_nearby(points[i].lon, points[i].lat, count);
+            Tree::ItemRange got = tree.get_nearby(points[i].lon, points[i].lat, count, scratch);
+            REQUIRE(got.size() == expect.size());
+            CHECK(vector<Tree::Item>(got.begin(), got.end()) == expect);
+        }
+    }
+}
+
+
+TEST_CASE("iter_nearest") {
+    srand(18);
+    vector<Tree::Item> data = rand_items(3000, 116, 40, 1);
+    vector<Tree::Item> far = rand_items(50, 0, 0, 180);
+    data.insert(data.end(), far.begin(), far.end());
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i].value = i;
+    }
+    Tree tree(8);
+    tree.bulk_load(data.begin(), data.end());
+
+    for (size_t round = 0; round < 10; ++round) {
+        float lon = round < 5 ? rand_range(115, 117) : rand_range(-180, 180);
+        float lat = round < 5 ? rand_range(39, 41) : rand_range(-85, 85);
+        vector<Tree::Item> sorted = data;
+        sort_by_dist(sorted, lon, lat);
+
+        // all of them in order
+        Tree::NearestIterator it = tree.iter_nearest(lon, lat);
+        vector<Tree::Item> got;
+        Tree::Item item;
+        while (it.next(item)) {
+            got.push_back(item);
+        }
+        CHECK(dists_of(got) == dists_of(sorted));
+
+        // early exit
+        Tree::NearestIterator head = tree.iter_nearest(lon, lat);
+        got.clear();
+        while (got.size() < 10 && head.next(item)) {
+            got.push_back(item);
+        }
+        CHECK(dists_of(got) == dists_of(tree.get_nearest(lon, lat, 10)));
+    }
+
+    Tree empty;
+    Tree::Item item;
+    CHECK(!empty.iter_nearest(116, 40).next(item));
+}
+
+
+struct IsMultipleOf {
+    T divisor;
+    size_t *calls;
+
+    bool operator()(const T &value) const {
+        (*this->calls)++;
+        return value % this->divisor == 0;
+    }
+};
+
+
+TEST_CASE("nearby_if") {
+    srand(19);
+    vector<Tree::Item> data = rand_items(5000, 116, 40, 1);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i].value = i;
+    }
+    Tree tree(8);
+    tree.bulk_load(data.begin(), data.end());
+
+    vector<size_t> counts = list_of(0)(1)(10)(100)(1000);
+    vector<T> divisors = list_of(1)(7)(100)(100000);
+    for (size_t round = 0; round < 10; ++round) {
+        float lon = rand_range(115.5, 116.5);
+        float lat = rand_range(39.5, 40.5);
+        for (size_t d = 0; d < divisors.size(); ++d) {
+            T divisor = divisors[d];
+            vector<Tree::Item> matched;
+            for (size_t i = 0; i < data.size(); ++i) {
+                if (data[i].value % divisor == 0) {
+                    matched.push_back(data[i]);
+                }
+            }
+            sort_by_dist(matched, lon, lat);
+
+            for (size_t c = 0; c < counts.size(); ++c) {
+                size_t count = counts[c];
+                size_t calls = 0;
+                IsMultipleOf pred = {divisor, &calls};
+                vector<Tree::Item> got = tree.get_nearby_if(lon, lat, count, pred);
+                vector<Tree::Item> expect(matched.begin(), matched.begin() + std::min(count, matched.size()));
+                CAPTURE(divisor);
+                CAPTURE(count);
+                REQUIRE(got.size() == expect.size());
+                CHECK(dists_of(got) == dists_of(expect));
+                for (size_t i = 0; i < got.size(); ++i) {
+                    CHECK(got[i].value % divisor == 0);
+                }
+                // only expanded as far as needed
+                if (count != 0 && count * divisor * 10 < data.size()) {
+                    CHECK(calls < data.size() / 2);
+                }
+            }
+        }
+    }
+}
+
+
+TEST_CASE("attrs") {
+    srand(20);
+    vector<Tree::Item> data = rand_items(3000, 116, 40, 1);
+    vector<uint32_t> attrs(data.size());
+    AttrTree tree(8);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i].value = i;
+        attrs[i] = rand() % 16;
+        CHECK(tree.insert(data[i].value, data[i].lon, data[i].lat, attrs[i]));
+    }
+    tree.verify();
+
+    // moves and inserts without attrs keep them, inserts with attrs and set_attrs replace them,
+    // splits and merges on the way
+    vector<bool> alive(data.size(), true);
+    for (size_t round = 0; round < 5000; ++round) {
+        T value = rand() % data.size();
+        float lon = rand_range(115, 117);
+        float lat = rand_range(39, 41);
+        uint32_t bits = rand() % 16;
+        switch (rand() % 5) {
+        case 0:
+            CHECK(tree.move(value, lon, lat) == alive[value]);
+            break;
+        case 1:
+            CHECK(tree.set_attrs(value, bits) == alive[value]);
+            attrs[value] = bits;
+            break;
+        case 2:
+            CHECK(tree.erase(value) == alive[value]);
+            alive[value] = false;
+            continue;
+        case 3:
+            CHECK(tree.insert(value, lon, lat) == !alive[value]);
+            if (!alive[value]) {
+                attrs[value] = 0;
+            }
+            alive[value] = true;
+            break;
+        default:
+            CHECK(tree.insert(value, lon, lat, bits) == !alive[value]);
+            alive[value] = true;
+            attrs[value] = bits;
+            break;
+        }
+        if (alive[value]) {
+            GeoLonLat lonlat = tree.geos.find(value)->second;
+            data[value].lon = lonlat.lon;
+            data[value].lat = lonlat.lat;
+        }
+        if (round % 500 == 0) {
+            tree.verify();
+        }
+    }
+    tree.verify();
+
+    vector<uint32_t> masks = list_of(0)(1)(3)(8)(15);
+    for (size_t round = 0; round < 10; ++round) {
+        float lon = rand_range(115, 117);
+        float lat = rand_range(39, 41);
+        for (size_t m = 0; m < masks.size(); ++m) {
+            uint32_t mask = masks[m];
+            vector<Tree::Item> matched;
+            for (size_t i = 0; i < data.size(); ++i) {
+                if (alive[i] && (attrs[i] & mask) == mask) {
+                    matched.push_back(data[i]);
+                }
+            }
+            sort_by_dist(matched, lon, lat);
+            CAPTURE(mask);
+
+            size_t count = 1 + rand() % 100;
+            vector<Tree::Item> got = tree.get_nearest_by_attrs(lon, lat, count, mask);
+            vector<Tree::Item> expect(matched.begin(), matched.begin() + std::min(count, matched.size()));
+            CHECK(dists_of(got) == dists_of(expect));
+
+            uint32_t meters = rand() % 50000;
+            expect.clear();
+            for (size_t i = 0; i < matched.size() && matched[i].dist <= meters; ++i) {
+                expect.push_back(matched[i]);
+            }
+            got = tree.get_within_radius_by_attrs(lon, lat, meters, mask);
+            CHECK(values_of(got) == values_of(expect));
+            got = tree.get_within_radius_by_attrs(lon, lat, meters, mask, GEO_NO_DIST);
+            CHECK(got.size() == expect.size());
+        }
+    }
+
+    // the legacy inserts of an existing value, in place and to another leaf
+    T value = 0;
+    while (!alive[value] || attrs[value] == 0) {
+        value++;
+    }
+    GeoLonLat lonlat = tree.geos.find(value)->second;
+    CHECK(!tree.insert(value, lonlat.lon + 0.00001f, lonlat.lat));
+    CHECK(!tree.insert(Tree::Item(value, -100, -40)));
+    CHECK(tree.get_nearest_by_attrs(-100, -40, 1, attrs[value])[0].value == value);
+    CHECK(!tree.insert(value, -100, -40, 0));
+    CHECK(tree.get_nearest_by_attrs(-100, -40, 1, attrs[value])[0].value != value);
+    tree.verify();
+
+    // merged into a leaf and split again
+    for (size_t i = 0; i < data.size(); ++i) {
+        tree.erase(i);
+    }
+    CHECK(tree.root == NULL);
+    CHECK(tree.get_nearest_by_attrs(116, 40, 10, 1).empty());
+}
+
+
+TEST_CASE("nearby_radius_by_count") {
+    srand(21);
+    vector<Tree::Item> data = rand_items(5000, 116, 40, 1);
+    vector<Tree::Item> far = rand_items(200, 0, 0, 180);
+    data.insert(data.end(), far.begin(), far.end());
+    Tree tree(16);
+    tree.bulk_load(data.begin(), data.end());
+
+    Tree::NearbyScratch scratch;
+    vector<size_t> counts = list_of(0)(1)(2)(10)(100)(1000)(10000);
+    for (size_t round = 0; round < 50; ++round) {
+        float lon = round < 40 ? rand_range(115, 117) : rand_range(-180, 180);
+        float lat = round < 40 ? rand_range(39, 41) : rand_range(-85, 85);
+        for (size_t c = 0; c < counts.size(); ++c) {
+            size_t count = counts[c];
+            vector<Tree::Item> items = tree.get_nearby(lon, lat, count);
+            uint32_t expect = items.empty() ? 0 : items.back().dist;
+            CAPTURE(lon);
+            CAPTURE(lat);
+            CAPTURE(count);
+            CHECK(tree.get_nearby_radius_by_count(lon, lat, count) == expect);
+            CHECK(tree.get_nearby_radius_by_count(lon, lat, count, scratch) == expect);
+        }
+    }
+
+    Tree empty;
+    CHECK(empty.get_nearby_radius_by_count(116, 40, 10) == 0);
+}
+
+
+TEST_CASE("estimate_radius_by_count") {
+    GeoBox box(0, 1, 1, 0);
+    CHECK(std::abs(box.area() - 111195.0 * 111195.0) / box.area() < 0.001);
+    double sphere = 4 * M_PI * EARTH_RADIUS_IN_METERS * EARTH_RADIUS_IN_METERS;
+    CHECK(std::abs(GeoBox().area() - sphere * sin(deg2rad(LAT_MAX))) / sphere < 1.0e-6);
+
+    // evenly spread items, the estimate stays close to the exact radius,
+    // which itself varies by ~1/(2 * sqrt(count)) between points
+    srand(22);
+    vector<Tree::Item> data = rand_items(50000, 116, 40, 2);
+    Tree tree(64);
+    tree.bulk_load(data.begin(), data.end());
+
+    vector<size_t> counts = list_of(10)(100)(1000)(10000);
+    for (size_t c = 0; c < counts.size(); ++c) {
+        size_t count = counts[c];
+        double total = 0;
+        size_t rounds = 200;
+        for (size_t round = 0; round < rounds; ++round) {
+            float lon = rand_range(115, 117);
+            float lat = rand_range(39, 41);
+            uint32_t exact = tree.get_nearest(lon, lat, count).back().dist;
+            uint32_t est = tree.estimate_radius_by_count(lon, lat, count);
+            CAPTURE(count);
+            CAPTURE(exact);
+            CAPTURE(est);
+            REQUIRE(est > 0);
+            double err = std::abs(log((double)est / exact));
+            CHECK(err < log(2.0));
+            total += err;
+        }
+        CAPTURE(count);
+        CHECK(total / rounds < (count < 100 ? log(1.2) : log(1.1)));
+    }
+
+    // more than all items, radius of the whole tree
+    CHECK(tree.estimate_radius_by_count(116, 40, 100000) > tree.estimate_radius_by_count(116, 40, 50000));
+
+    Tree empty;
+    CHECK(empty.estimate_radius_by_count(116, 40, 10) == 0);
+    CHECK(tree.estimate_radius_by_count(116, 40, 0) == 0);
+}
+
+
+static void write_bytes(const char *path, const vector<char> &buf) {
+    FILE *fp = fopen(path, "wb");
+    REQUIRE(fp != NULL);
+    REQUIRE(fwrite(buf.data(), 1, buf.size(), fp) == buf.size());
+    fclose(fp);
+}
+
+
+TEST_CASE("save_load") {
+    const char *path = "test_geotree.save";
+    srand(23);
+    vector<Tree::Item> data = rand_items(5000, 116, 40, 1);
+    AttrTree tree(16);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i].value = i;
+        tree.insert(data[i].value, data[i].lon, data[i].lat, i % 5);
+    }
+    for (size_t i = 0; i < data.size(); i += 3) {
+        tree.erase(data[i].value);
+    }
+    REQUIRE(tree.save(path));
+
+    AttrTree loaded;
+    REQUIRE(loaded.load(path));
+    loaded.verify();
+    CHECK(loaded.get_all() == tree.get_all());
+    CHECK(count_nodes(loaded.root) == count_nodes(tree.root));
+    CHECK(loaded.split_threshold == tree.split_threshold);
+    CHECK(loaded.merge_threshold == tree.merge_threshold);
+    for (size_t round = 0; round < 20; ++round) {
+        float lon = rand_range(115, 117);
+        float lat = rand_range(39, 41);
+        CHECK(loaded.get_nearby(lon, lat, 50) == tree.get_nearby(lon, lat, 50));
+        CHECK(dists_of(loaded.get_nearest_by_attrs(lon, lat, 50, 2)) == dists_of(tree.get_nearest_by_attrs(lon, lat, 50, 2)));
+    }
+    // still writable
+    CHECK(loaded.insert(100000, 116, 40));
+    CHECK(loaded.erase(data[1].value));
+    loaded.verify();
+
+    vector<char> good;
+    REQUIRE(geo_read_file(path, good));
+
+    // rejected files leave the tree unchanged
+    AttrTree other(8);
+    other.insert(1, 2, 3);
+    CHECK(!other.load("no/such/file"));
+
+    vector<char> bad(good.begin(), good.end() - 1);
+    write_bytes(path, bad);
+    CHECK(!other.load(path));
+
+    bad.assign(good.begin(), good.begin() + 20);
+    write_bytes(path, bad);
+    CHECK(!other.load(path));
+
+    bad = good;
+    bad[bad.size() / 2] ^= 1;
+    write_bytes(path, bad);
+    CHECK(!other.load(path));
+
+    bad = good;
+    bad[4] += 1;    // version
+    write_bytes(path, bad);
+    CHECK(!other.load(path));
+
+    write_bytes(path, good);
+    GeoTree<int64_t> wide;
+    CHECK(!wide.load(path));
+
+    CHECK(other.size() == 1);
+    other.verify();
+
+    // empty tree
+    AttrTree empty;
+    REQUIRE(empty.save(path));
+    CHECK(other.load(path));
+    CHECK(other.size() == 0);
+    CHECK(other.root == NULL);
+
+    remove(path);
+}
+
+
+// nodes of a pool not on its free list
+template<bool ATTRS>
+static size_t pool_live(const GeoNodePool<T, ATTRS> &pool) {
+    size_t total = pool.slabs.empty() ? 0 : (pool.slabs.size() - 1) * 256 + pool.used;
+    for (const GeoNode<T, ATTRS> *node = pool.free_list; node != NULL; node = node->NW) {
+        total--;
+    }
+    return total;
+}
+
+
+struct SnapshotReader {
+    const AttrTree::Snapshot *snap;
+    const vector<vector<uint32_t> > *expect;
+    bool ok;
+
+    void operator()() {
+        for (size_t round = 0; round < 20; ++round) {
+            for (size_t i = 0; i < this->expect->size(); ++i) {
+                float lon = 115.5 + i * 0.1;
+                if (dists_of(this->snap->get_nearest(lon, 40, 30)) != (*this->expect)[i]) {
+                    this->ok = false;
+                }
+            }
+        }
+    }
+};
+
+
+TEST_CASE("snapshot") {
+    srand(24);
+    vector<Tree::Item> data = rand_items(3000, 116, 40, 1);
+    AttrTree tree(8);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i].value = i;
+        tree.insert(data[i].value, data[i].lon, data[i].lat, i % 3);
+    }
+
+    AttrTree::Snapshot snap = tree.snapshot();
+    Tree copy;
+    copy.bulk_load(data.begin(), data.end());
+    CHECK(pool_live(tree.alloc) == count_nodes(tree.root));
+
+    // get_nearby depends on the shape, compare with the tree before writes
+    vector<GeoLonLat> points;
+    vector<vector<Tree::Item> > nearbys;
+    vector<uint32_t> radiuses;
+    for (size_t i = 0; i < 20; ++i) {
+        points.push_back(GeoLonLat(rand_range(115, 117), rand_range(39, 41)));
+        nearbys.push_back(tree.get_nearby(points[i].lon, points[i].lat, 50));
+        radiuses.push_back(tree.get_nearby_radius_by_count(points[i].lon, points[i].lat, 20));
+    }
+
+    // split, merge and re-route under the snapshot
+    for (size_t round = 0; round < 5000; ++round) {
+        T value = rand() % data.size();
+        float lon = rand_range(115, 117);
+        float lat = rand_range(39, 41);
+        switch (rand() % 4) {
+        case 0:
+            tree.move(value, lon, lat);
+            break;
+        case 1:
+            tree.erase(value);
+            break;
+        case 2:
+            tree.set_attrs(value, 7);
+            break;
+        default:
+            tree.insert(value, lon, lat);
+            break;
+        }
+        if (round == 2500) {
+            AttrTree::Snapshot second = snap;
+            snap = tree.snapshot();
+            snap = second;
+        }
+    }
+    tree.verify();
+    CHECK(snap.size() == data.size());
+    for (size_t i = 0; i < points.size(); ++i) {
+        float lon = points[i].lon;
+        float lat = points[i].lat;
+        CHECK(snap.get_nearby(lon, lat, 50) == nearbys[i]);
+        CHECK(snap.get_nearby_radius_by_count(lon, lat, 20) == radiuses[i]);
+        CHECK(dists_of(snap.get_nearest(lon, lat, 50)) == dists_of(copy.get_nearest(lon, lat, 50)));
+        CHECK(dists_of(snap.get_within_radius(lon, lat, 3000)) == dists_of(copy.get_within_radius(lon, lat, 3000)));
+        GeoBox box(lon - 0.1, lon + 0.1, lat + 0.1, lat - 0.1);
+        CHECK(snap.count_in_box(box) == copy.count_in_box(box));
+    }
+
+    // read from another thread while the tree is written
+    vector<vector<uint32_t> > expect;
+    for (size_t i = 0; i < 10; ++i) {
+        expect.push_back(dists_of(copy.get_nearest(115.5 + i * 0.1, 40, 30)));
+    }
+    SnapshotReader reader = {&snap, &expect, true};
+    std::thread thread(std::ref(reader));
+    for (size_t round = 0; round < 3000; ++round) {
+        tree.move(rand() % data.size(), rand_range(115, 117), rand_range(39, 41));
+    }
+    thread.join();
+    CHECK(reader.ok);
+
+    // a snapshot outlives clear, its nodes are freed by the next write after it
+    {
+        AttrTree::Snapshot last = tree.snapshot();
+        size_t size = tree.size();
+        tree.clear();
+        CHECK(last.size() == size);
+        CHECK(last.get_nearest(116, 40, 10).size() == 10);
+    }
+    snap = tree.snapshot();
+    tree.insert(1, 116, 40);
+    CHECK(tree.snapshots.load() == 1);
+}
+
+
+struct SnapshotDropper {
+    Tree::Snapshot *snap;
+    std::atomic<bool> *go;
+
+    void operator()() {
+        while (!this->go->load()) {
+            std::this_thread::yield();
+        }
+        delete this->snap;
+    }
+};
+
+
+TEST_CASE("snapshot.clear") {
+    srand(26);
+    vector<Tree::Item> data = rand_items(200, 116, 40, 1);
+    Tree tree(8);
+    for (size_t round = 0; round < 2000; ++round) {
+        tree.bulk_load(data.begin(), data.end());
+        // the old root is left to the snapshot only, its destruction orphans it
+        std::atomic<bool> go(false);
+        SnapshotDropper dropper = {new Tree::Snapshot(tree.snapshot()), &go};
+        tree.move(data[0].value, 116, 40);
+
+        // destroyed while clear runs
+        std::thread thread(dropper);
+        go = true;
+        tree.clear();
+        thread.join();
+
+        tree.insert(data[1]);
+        CHECK(!tree.has_orphans.load());
+        CHECK(tree.snapshots.load() == 0);
+        CHECK(pool_live(tree.alloc) == count_nodes(tree.root));
+    }
+}
+
+
+TEST_CASE("snapshot.reclaim") {
+    srand(25);
+    vector<Tree::Item> data = rand_items(2000, 116, 40, 1);
+    Tree tree(8);
+    for (size_t i = 0; i < data.size(); ++i) {
+        tree.insert(data[i]);
+    }
+    {
+        Tree::Snapshot snap = tree.snapshot();
+        for (size_t i = 0; i < data.size(); i += 2) {
+            tree.move(data[i].value, rand_range(115, 117), rand_range(39, 41));
+        }
+        CHECK(pool_live(tree.alloc) > count_nodes(tree.root));
+    }
+    CHECK(tree.has_orphans.load());
+    tree.erase(data[1].value);
+    CHECK(!tree.has_orphans.load());
+    tree.verify();
+    CHECK(pool_live(tree.alloc) == count_nodes(tree.root));
+
+    // not shared, no copy
+    tree.move(data[0].value, 116, 40);
+    CHECK(pool_live(tree.alloc) == count_nodes(tree.root));
+
+    typedef GeoTree<T, GeoNodeHeapAlloc<T> > HeapTree;
+    HeapTree heap_tree(4);
+    for (size_t i = 0; i < 500; ++i) {
+        heap_tree.insert(data[i].value, data[i].lon, data[i].lat);
+    }
+    HeapTree::Snapshot snap = heap_tree.snapshot();
+    heap_tree.clear();
+    CHECK(snap.size() == 500);
+}
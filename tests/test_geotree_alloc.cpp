@@ -0,0 +1,69 @@
+#include <algorithm>
+#include <vector>
+#include <cstdlib>
+#include <new>
+
+#include "catch.h"
+
+#define private public
+#include "../geotree.hpp"
+#include "geo_test_util.hpp"
+
+
+using namespace std;
+using namespace geotools;
+
+
+// count heap allocations, the replacement is global to this binary which runs no other threads
+static size_t g_allocs = 0;
+
+void *operator new(size_t size) {
+    g_allocs++;
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+
+typedef int T;
+typedef GeoTree<T> Tree;
+
+
+TEST_CASE("alloc.nearby_scratch") {
+    srand(17);
+    vector<Tree::Item> data = rand_items(5000, 116, 40, 1);
+    Tree tree(8);
+    tree.bulk_load(data.begin(), data.end());
+
+    vector<GeoLonLat> points;
+    for (size_t i = 0; i < 100; ++i) {
+        points.push_back(GeoLonLat(rand_range(115.5, 116.5), rand_range(39.5, 40.5)));
+    }
+
+    size_t counts[] = {0, 1, 10, 100, 6000};
+    Tree::NearbyScratch scratch;
+    for (size_t k = 0; k < sizeof(counts) / sizeof(counts[0]); ++k) {
+        for (size_t i = 0; i < points.size(); ++i) {
+            tree.get_nearby(points[i].lon, points[i].lat, counts[k], scratch);
+        }
+    }
+
+    // buffers have grown, no more allocation
+    size_t allocs = g_allocs;
+    for (size_t k = 0; k < sizeof(counts) / sizeof(counts[0]); ++k) {
+        for (size_t i = 0; i < points.size(); ++i) {
+            tree.get_nearby(points[i].lon, points[i].lat, counts[k], scratch, GEO_NO_SORT);
+        }
+    }
+    CHECK(g_allocs == allocs);
+}
@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <vector>
+#include <cstdlib>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+#include "catch.h"
+
+#define private public
+#include "../geotree_concurrent.hpp"
+#include "geo_test_util.hpp"
+
+
+using namespace std;
+using namespace geotools;
+
+
+typedef int T;
+typedef GeoTree<T> Tree;
+typedef ConcurrentGeoTree<T> CTree;
+typedef GeoTree<T, GeoNodePool<T, true> > AttrTree;
+typedef ConcurrentGeoTree<T, GeoNodePool<T, true> > AttrCTree;
+
+
+template<class N>
+static size_t count_nodes(const N *node) {
+    if (node == NULL) {
+        return 0;
+    }
+    return 1 + count_nodes(node->NW) + count_nodes(node->NE) + count_nodes(node->SE) + count_nodes(node->SW);
+}
+
+
+TEST_CASE("concurrent.same_as_geotree") {
+    srand(13);
+    vector<Tree::Item> data = rand_items(3000, 116, 40, 1);
+
+    Tree tree(8);
+    CTree ctree(8);
+    for (size_t i = 0; i < data.size(); ++i) {
+        CHECK(tree.insert(data[i]) == ctree.insert(data[i]));
+    }
+    ctree.verify();
+
+    // moves, erases and re-inserts, split and merge on the way
+    for (size_t round = 0; round < 5000; ++round) {
+        T value = rand() % data.size();
+        float lon = rand_range(115, 117);
+        float lat = rand_range(39, 41);
+        switch (rand() % 3) {
+        case 0:
+            CHECK(tree.move(value, lon, lat) == ctree.move(value, lon, lat));
+            break;
+        case 1:
+            CHECK(tree.erase(value) == ctree.erase(value));
+            break;
+        default:
+            CHECK(tree.insert(value, lon, lat) == ctree.insert(value, lon, lat));
+            break;
+        }
+    }
+    ctree.verify();
+    REQUIRE(ctree.size() == tree.size());
+    CHECK(ctree.get_all() == tree.get_all());
+    CHECK(count_nodes(ctree.root.load()) == count_nodes(tree.root));
+
+    for (size_t round = 0; round < 20; ++round) {
+        float lon = rand_range(115, 117);
+        float lat = rand_range(39, 41);
+        size_t count = 1 + rand() % 200;
+        CHECK(ctree.get_nearby(lon, lat, count) == tree.get_nearby(lon, lat, count));
+        CHECK(dists_of(ctree.get_nearest(lon, lat, count)) == dists_of(tree.get_nearest(lon, lat, count)));
+        CHECK(ctree.get_nearby_radius_by_count(lon, lat, count) == tree.get_nearby_radius_by_count(lon, lat, count));
+        CHECK(dists_of(ctree.get_within_radius(lon, lat, 5000)) == dists_of(tree.get_within_radius(lon, lat, 5000)));
+        GeoBox box(lon - 0.1, lon + 0.1, lat + 0.1, lat - 0.1);
+        CHECK(ctree.count_in_box(box) == tree.count_in_box(box));
+    }
+
+    ctree.bulk_load(data.begin(), data.end());
+    ctree.verify();
+    CHECK(ctree.size() == data.size());
+
+    ctree.clear();
+    CHECK(ctree.size() == 0);
+    CHECK(ctree.retired.empty());
+}
+
+
+TEST_CASE("concurrent.attrs") {
+    srand(15);
+    vector<Tree::Item> data = rand_items(2000, 116, 40, 1);
+
+    AttrTree tree(8);
+    AttrCTree ctree(8);
+    for (size_t i = 0; i < data.size(); ++i) {
+        uint32_t attrs = rand() % 8;
+        CHECK(tree.insert(data[i].value, data[i].lon, data[i].lat, attrs)
+            == ctree.insert(data[i].value, data[i].lon, data[i].lat, attrs));
+    }
+    for (size_t round = 0; round < 2000; ++round) {
+        T value = rand() % (data.size() + 100);
+        uint32_t attrs = rand() % 8;
+        CHECK(tree.set_attrs(value, attrs) == ctree.set_attrs(value, attrs));
+    }
+    ctree.verify();
+
+    for (size_t round = 0; round < 20; ++round) {
+        float lon = rand_range(115, 117);
+        float lat = rand_range(39, 41);
+        size_t count = 1 + rand() % 100;
+        uint32_t mask = 1 + rand() % 7;
+        CHECK(dists_of(ctree.get_nearest_by_attrs(lon, lat, count, mask))
+            == dists_of(tree.get_nearest_by_attrs(lon, lat, count, mask)));
+        CHECK(dists_of(ctree.get_within_radius_by_attrs(lon, lat, 5000, mask))
+            == dists_of(tree.get_within_radius_by_attrs(lon, lat, 5000, mask)));
+    }
+}
+
+
+struct NearestReader {
+    const CTree *tree;
+    const boost::atomic<bool> *stop;
+    size_t count;
+    size_t rounds;
+    bool ok;
+
+    void operator()() {
+        while (!stop->load()) {
+            float lon = rand_range(115, 117);
+            float lat = rand_range(39, 41);
+            vector<Tree::Item> got = tree->get_nearest(lon, lat, this->count);
+            // writer only moves points, size is stable
+            if (got.size() != this->count || !std::is_sorted(got.begin(), got.end())) {
+                this->ok = false;
+            }
+            this->rounds++;
+        }
+    }
+};
+
+
+TEST_CASE("concurrent.threads") {
+    srand(14);
+    vector<Tree::Item> data = rand_items(5000, 116, 40, 1);
+    CTree ctree(16);
+    ctree.bulk_load(data.begin(), data.end());
+
+    boost::atomic<bool> stop(false);
+    vector<NearestReader> readers(4);
+    boost::thread_group group;
+    for (size_t i = 0; i < readers.size(); ++i) {
+        NearestReader reader = {&ctree, &stop, 10 + i * 50, 0, true};
+        readers[i] = reader;
+        group.create_thread(boost::ref(readers[i]));
+    }
+
+    for (size_t round = 0; round < 20000; ++round) {
+        T value = rand() % data.size();
+        CHECK(ctree.move(value, rand_range(115, 117), rand_range(39, 41)));
+    }
+    stop = true;
+    group.join_all();
+
+    for (size_t i = 0; i < readers.size(); ++i) {
+        CHECK(readers[i].ok);
+        CHECK(readers[i].rounds > 0);
+    }
+    ctree.verify();
+    CHECK(ctree.size() == data.size());
+}
@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "catch.h"
+
+#define private public
+#include "../geotree_frozen.hpp"
+#include "geo_test_util.hpp"
+
+
+using namespace std;
+using namespace geotools;
+
+
+typedef int T;
+typedef GeoTree<T> Tree;
+typedef GeoFrozenTree<T> FTree;
+
+
+static vector<T> sorted_values(const vector<Tree::Item> &items) {
+    vector<T> values;
+    for (size_t i = 0; i < items.size(); ++i) {
+        values.push_back(items[i].value);
+    }
+    sort(values.begin(), values.end());
+    return values;
+}
+
+
+struct BoxCollector {
+    vector<T> values;
+
+    void operator()(const T &value, float, float) {
+        this->values.push_back(value);
+    }
+};
+
+
+TEST_CASE("frozen.same_as_geotree") {
+    const char *path = "test_geotree_frozen.bin";
+    srand(24);
+    vector<Tree::Item> data = rand_items(5000, 116, 40, 1);
+    vector<Tree::Item> far = rand_items(200, 0, 0, 180);
+    data.insert(data.end(), far.begin(), far.end());
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i].value = i;
+    }
+    Tree tree(16);
+    for (size_t i = 0; i < data.size(); ++i) {
+        tree.insert(data[i]);
+    }
+    REQUIRE(FTree::write(tree, path));
+
+    FTree frozen;
+    REQUIRE(frozen.open(path, true));
+    REQUIRE(frozen.is_open());
+    REQUIRE(frozen.size() == tree.size());
+
+    size_t counts[] = {0, 1, 7, 100, 1000, 10000};
+    for (size_t round = 0; round < 20; ++round) {
+        float lon = round < 15 ? rand_range(115, 117) : rand_range(-180, 180);
+        float lat = round < 15 ? rand_range(39, 41) : rand_range(-85, 85);
+        CAPTURE(lon);
+        CAPTURE(lat);
+        for (size_t k = 0; k < sizeof(counts) / sizeof(counts[0]); ++k) {
+            size_t count = counts[k];
+            CAPTURE(count);
+            CHECK(dists_of(frozen.get_nearest(lon, lat, count)) == dists_of(tree.get_nearest(lon, lat, count)));
+        }
+
+        uint32_t meters = rand() % 100000;
+        vector<Tree::Item> expect = tree.get_within_radius(lon, lat, meters);
+        CHECK(dists_of(frozen.get_within_radius(lon, lat, meters)) == dists_of(expect));
+        CHECK(sorted_values(frozen.get_within_radius(lon, lat, meters, GEO_NO_DIST)) == sorted_values(expect));
+        CHECK(frozen.get_within_radius(lon, lat, meters, GEO_NO_DIST, 10).size() == std::min<size_t>(10, expect.size()));
+
+        GeoBox box(lon - 0.3, lon + 0.3, lat + 0.2, lat - 0.2);
+        CHECK(frozen.count_in_box(box) == tree.count_in_box(box));
+        BoxCollector got = frozen.query_box(box, BoxCollector());
+        BoxCollector want = tree.query_box(box, BoxCollector());
+        sort(got.values.begin(), got.values.end());
+        sort(want.values.begin(), want.values.end());
+        CHECK(got.values == want.values);
+    }
+
+    // a second mapping of the same file
+    FTree other;
+    REQUIRE(other.open(path));
+    CHECK(other.get_nearest(116, 40, 10) == frozen.get_nearest(116, 40, 10));
+    remove(path);
+}
+
+
+TEST_CASE("frozen.reject") {
+    const char *path = "test_geotree_frozen.bin";
+    srand(25);
+    vector<Tree::Item> data = rand_items(1000, 116, 40, 1);
+    Tree tree(8);
+    tree.bulk_load(data.begin(), data.end());
+    REQUIRE(FTree::write(tree, path));
+
+    vector<char> good;
+    REQUIRE(geo_read_file(path, good));
+    FTree frozen;
+    CHECK(!frozen.open("no/such/file"));
+
+    // truncated
+    vector<char> bad(good.begin(), good.end() - 4);
+    FILE *fp = fopen(path, "wb");
+    fwrite(bad.data(), 1, bad.size(), fp);
+    fclose(fp);
+    CHECK(!frozen.open(path));
+    CHECK(!frozen.is_open());
+
+    // only the checked open reads the body
+    bad = good;
+    bad[bad.size() - 1] ^= 1;
+    fp = fopen(path, "wb");
+    fwrite(bad.data(), 1, bad.size(), fp);
+    fclose(fp);
+    CHECK(frozen.open(path));
+    CHECK(!frozen.open(path, true));
+
+    // nodes are always checked, a child out of the node section or an item range past the
+    // arrays is never followed
+    FTree::Header header;
+    memcpy(&header, good.data(), sizeof(header));
+    size_t root = header.offsets[FTree::SEC_NODES];
+    for (size_t field = 0; field < 2; ++field) {
+        bad = good;
+        GeoFrozenNode node;
+        memcpy(&node, &bad[root], sizeof(node));
+        REQUIRE(node.type == GEONODE_INNER);
+        if (field == 0) {
+            node.children[0] = node.children[1] = 1000000;
+        } else {
+            node.count = 1000000;
+        }
+        memcpy(&bad[root], &node, sizeof(node));
+        fp = fopen(path, "wb");
+        fwrite(bad.data(), 1, bad.size(), fp);
+        fclose(fp);
+        CHECK(!frozen.open(path));
+    }
+
+    GeoFrozenTree<int64_t> wide;
+    REQUIRE(FTree::write(tree, path));
+    CHECK(!wide.open(path));
+
+    // empty tree
+    Tree empty;
+    REQUIRE(FTree::write(empty, path));
+    REQUIRE(frozen.open(path, true));
+    CHECK(frozen.size() == 0);
+    CHECK(frozen.get_nearest(116, 40, 10).empty());
+    CHECK(frozen.get_within_radius(116, 40, 1000).empty());
+    CHECK(frozen.count_in_box(GeoBox()) == 0);
+    frozen.close();
+    remove(path);
+}
@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <vector>
+#include <cstdlib>
+
+#include <boost/thread/thread.hpp>
+#include "catch.h"
+
+#define private public
+#include "../geotree_sharded.hpp"
+#include "geo_test_util.hpp"
+
+
+using namespace std;
+using namespace geotools;
+
+
+typedef int T;
+typedef GeoTree<T> Tree;
+typedef ShardedGeoTree<T> STree;
+
+
+TEST_CASE("sharded.shard_of") {
+    STree tree(8, 2);
+    REQUIRE(tree.shard_count() == 16);
+    for (size_t i = 0; i < tree.shard_count(); ++i) {
+        const GeoBox &box = tree.shards[i]->box;
+        GeoLonLat center((box.W + box.E) / 2, (box.N + box.S) / 2);
+        CHECK(tree.shard_of(center) == i);
+        CHECK(tree.shard_of(GeoLonLat(box.W, box.S)) == i);
+    }
+    CHECK(tree.shard_of(GeoLonLat(LON_MIN, LAT_MIN)) == 0);
+    CHECK(tree.shard_of(GeoLonLat(LON_MAX, LAT_MAX)) == 15);
+}
+
+
+TEST_CASE("sharded.same_as_geotree") {
+    srand(15);
+    // around a corner of 4 level 4 shards, and some far away
+    vector<Tree::Item> data = rand_items(3000, 0, 0, 2);
+    vector<Tree::Item> far = rand_items(200, 0, 0, 180);
+    data.insert(data.end(), far.begin(), far.end());
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i].value = i;
+    }
+
+    Tree tree(8);
+    STree stree(8);
+    for (size_t i = 0; i < data.size(); ++i) {
+        CHECK(tree.insert(data[i]) == stree.insert(data[i]));
+    }
+    for (size_t round = 0; round < 3000; ++round) {
+        T value = rand() % data.size();
+        float lon = rand_range(-2, 2);
+        float lat = rand_range(-2, 2);
+        switch (rand() % 3) {
+        case 0:
+            CHECK(tree.move(value, lon, lat) == stree.move(value, lon, lat));
+            break;
+        case 1:
+            CHECK(tree.erase(value) == stree.erase(value));
+            break;
+        default:
+            CHECK(tree.insert(value, lon, lat) == stree.insert(value, lon, lat));
+            break;
+        }
+    }
+    stree.verify();
+    REQUIRE(stree.size() == tree.size());
+
+    size_t counts[] = {0, 1, 7, 100, 1000, 5000};
+    for (size_t round = 0; round < 20; ++round) {
+        float lon = round < 10 ? rand_range(-2, 2) : rand_range(-180, 180);
+        float lat = round < 10 ? rand_range(-2, 2) : rand_range(-85, 85);
+        CAPTURE(lon);
+        CAPTURE(lat);
+        for (size_t k = 0; k < sizeof(counts) / sizeof(counts[0]); ++k) {
+            size_t count = counts[k];
+            CAPTURE(count);
+            vector<Tree::Item> expect = tree.get_nearest(lon, lat, count);
+            CHECK(dists_of(stree.get_nearest(lon, lat, count)) == dists_of(expect));
+            CHECK(stree.get_nearest_radius_by_count(lon, lat, count) == (expect.empty() ? 0 : expect.back().dist));
+        }
+
+        uint32_t meters = rand() % 300000;
+        CHECK(dists_of(stree.get_within_radius(lon, lat, meters))
+            == dists_of(tree.get_within_radius(lon, lat, meters)));
+        CHECK(stree.get_within_radius(lon, lat, meters, GEO_OPT_NONE, 10).size()
+            == tree.get_within_radius(lon, lat, meters, GEO_OPT_NONE, 10).size());
+
+        GeoBox box(lon - 1, lon + 1, lat + 1, lat - 1);
+        CHECK(stree.count_in_box(box) == tree.count_in_box(box));
+    }
+}
+
+
+struct CityWriter {
+    STree *tree;
+    T first;
+    float lon;
+    float lat;
+
+    void operator()() {
+        for (size_t round = 0; round < 20000; ++round) {
+            T value = this->first + round % 500;
+            this->tree->insert(value, this->lon + (round % 97) * 0.001, this->lat + (round % 89) * 0.001);
+            if (round % 7 == 0) {
+                this->tree->erase(value);
+            }
+        }
+    }
+};
+
+
+TEST_CASE("sharded.threads") {
+    STree tree(16);
+    CityWriter writers[] = {
+        {&tree, 0, 116.3, 39.9},
+        {&tree, 1000, 121.4, 31.2},
+        {&tree, 2000, -74.0, 40.7},
+        {&tree, 3000, 2.3, 48.8},
+        // straddles the corner of four shards
+        {&tree, 500, -0.05, -0.04},
+    };
+
+    boost::thread_group group;
+    for (size_t i = 0; i < sizeof(writers) / sizeof(writers[0]); ++i) {
+        group.create_thread(writers[i]);
+    }
+    for (size_t round = 0; round < 2000; ++round) {
+        vector<Tree::Item> got = tree.get_nearest(116.3, 39.9, 10);
+        CHECK(got.size() <= 10);
+    }
+    group.join_all();
+    tree.verify();
+}
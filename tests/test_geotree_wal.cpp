@@ -0,0 +1,355 @@
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+#include <boost/thread/thread.hpp>
+#include "catch.h"
+
+#define private public
+#include "../geotree_wal.hpp"
+#include "geo_test_util.hpp"
+
+
+using namespace std;
+using namespace geotools;
+
+
+typedef int T;
+typedef GeoLoggedTree<T> LTree;
+typedef LTree::Tree Tree;
+
+static const char *PATH = "test_geotree_wal.db";
+
+
+static void remove_files() {
+    for (uint64_t gen = 1; gen < 100; ++gen) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s.log.%llu", PATH, (unsigned long long)gen);
+        remove(name);
+        snprintf(name, sizeof(name), "%s.ckpt.%llu", PATH, (unsigned long long)gen);
+        remove(name);
+    }
+}
+
+
+static vector<uint64_t> log_gens(const LTree &tree) {
+    vector<uint64_t> gens;
+    tree.list_logs(gens);
+    return gens;
+}
+
+
+static vector<uint64_t> ckpt_gens(const LTree &tree) {
+    vector<uint64_t> gens;
+    tree.list_ckpts(gens);
+    return gens;
+}
+
+
+static long file_size(const string &path) {
+    vector<char> buf;
+    return geo_read_file(path.c_str(), buf) ? (long)buf.size() : -1;
+}
+
+
+// random writes to the logged tree
+static void rand_writes(LTree &tree, size_t rounds, size_t values) {
+    for (size_t round = 0; round < rounds; ++round) {
+        T value = rand() % values;
+        float lon = rand_range(115, 117);
+        float lat = rand_range(39, 41);
+        switch (rand() % 5) {
+        case 0:
+            tree.move(value, lon, lat);
+            break;
+        case 1:
+            tree.erase(value);
+            break;
+        case 2:
+            tree.set_attrs(value, rand() % 4);
+            break;
+        case 3:
+            tree.insert(value, lon, lat);
+            break;
+        default:
+            tree.insert(value, lon, lat, rand() % 4);
+            break;
+        }
+    }
+}
+
+
+static void check_same(const Tree &got, const Tree &expect) {
+    got.verify();
+    REQUIRE(got.size() == expect.size());
+    CHECK(got.get_all() == expect.get_all());
+    for (size_t round = 0; round < 10; ++round) {
+        float lon = rand_range(115, 117);
+        float lat = rand_range(39, 41);
+        vector<Tree::Item> a = got.get_nearest_by_attrs(lon, lat, 30, 2);
+        vector<Tree::Item> b = expect.get_nearest_by_attrs(lon, lat, 30, 2);
+        CHECK(a.size() == b.size());
+        for (size_t i = 0; i < a.size() && i < b.size(); ++i) {
+            CHECK(a[i].dist == b[i].dist);
+        }
+    }
+}
+
+
+// tree of a file of GeoTree::save
+static void copy_tree(LTree &from, Tree &to) {
+    const char *path = "test_geotree_wal.copy";
+    REQUIRE(from.get_tree().save(path));
+    REQUIRE(to.load(path));
+    remove(path);
+}
+
+
+TEST_CASE("wal.replay") {
+    srand(31);
+    remove_files();
+    GeoLogOptions options;
+    options.checkpoint_records = 0;
+
+    Tree expect;
+    {
+        LTree tree(8);
+        REQUIRE(tree.open(PATH, options));
+        CHECK(tree.size() == 0);
+        rand_writes(tree, 20000, 3000);
+        CHECK(tree.sync());
+        copy_tree(tree, expect);
+        CHECK(log_gens(tree) == vector<uint64_t>(1, 1));
+    }
+
+    // replayed and checkpointed on open
+    LTree tree(8);
+    REQUIRE(tree.open(PATH, options));
+    check_same(tree.get_tree(), expect);
+    CHECK(file_size(tree.ckpt_path(tree.gen)) > 0);
+    CHECK(ckpt_gens(tree) == vector<uint64_t>(1, tree.gen));
+    CHECK(log_gens(tree) == vector<uint64_t>(1, tree.gen));
+
+    rand_writes(tree, 5000, 3000);
+    copy_tree(tree, expect);
+    tree.close();
+    REQUIRE(tree.open(PATH, options));
+    check_same(tree.get_tree(), expect);
+    tree.close();
+    remove_files();
+}
+
+
+TEST_CASE("wal.group_commit") {
+    remove_files();
+    GeoLogOptions options;
+    options.flush_ms = 60000;
+    options.checkpoint_records = 0;
+
+    LTree tree;
+    REQUIRE(tree.open(PATH, options));
+    for (size_t i = 0; i < 100; ++i) {
+        tree.insert(i, 116, 40);
+    }
+    CHECK(tree.sync());
+    // one group of all records
+    size_t record = 1 + sizeof(T) + 2 * sizeof(float);
+    string log = tree.log_path(1);
+    CHECK(file_size(log) == (long)(sizeof(LTree::LogHeader) + sizeof(LTree::GroupHeader) + 100 * record));
+    CHECK(tree.flushed == 100);
+
+    // no-ops are not logged
+    CHECK(!tree.erase(1000));
+    CHECK(!tree.move(1000, 1, 2));
+    CHECK(tree.erase(0));
+    CHECK(tree.sync());
+    CHECK(file_size(log) == (long)(sizeof(LTree::LogHeader) + 2 * sizeof(LTree::GroupHeader) + 100 * record + 1 + sizeof(T)));
+
+    // written in the background without sync once the window passes
+    tree.close();
+    options.flush_ms = 1;
+    REQUIRE(tree.open(PATH, options));
+    CHECK(tree.size() == 99);
+    tree.insert(1000, 116, 40);
+    for (size_t i = 0; i < 1000 && tree.flushed == 0; ++i) {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+    }
+    CHECK(tree.flushed == 1);
+    tree.close();
+    remove_files();
+}
+
+
+TEST_CASE("wal.torn") {
+    srand(32);
+    remove_files();
+    GeoLogOptions options;
+    options.flush_ms = 60000;
+    options.checkpoint_records = 0;
+
+    Tree expect;
+    string log;
+    {
+        LTree tree(8);
+        REQUIRE(tree.open(PATH, options));
+        rand_writes(tree, 3000, 1000);
+        CHECK(tree.sync());
+        copy_tree(tree, expect);
+        rand_writes(tree, 3000, 1000);
+        log = tree.log_path(tree.gen);
+    }
+
+    vector<char> good;
+    REQUIRE(geo_read_file(log.c_str(), good));
+
+    // the last group is cut short
+    vector<char> bad(good.begin(), good.end() - 5);
+    REQUIRE(geo_write_file(log.c_str(), bad));
+    {
+        LTree tree(8);
+        REQUIRE(tree.open(PATH, options));
+        check_same(tree.get_tree(), expect);
+        tree.close();
+    }
+
+    // or corrupted, without a checkpoint
+    remove_files();
+    bad = good;
+    bad[bad.size() - 100] ^= 1;
+    REQUIRE(geo_write_file(log.c_str(), bad));
+    {
+        LTree tree(8);
+        REQUIRE(tree.open(PATH, options));
+        check_same(tree.get_tree(), expect);
+        tree.close();
+    }
+    remove_files();
+}
+
+
+TEST_CASE("wal.checkpoint") {
+    srand(33);
+    remove_files();
+    GeoLogOptions options;
+    options.flush_ms = 1;
+    options.checkpoint_records = 1000;
+
+    Tree expect;
+    {
+        LTree tree(8);
+        REQUIRE(tree.open(PATH, options));
+        for (size_t round = 0; round < 20; ++round) {
+            rand_writes(tree, 1000, 2000);
+            // a snapshot being saved never blocks the writer
+            boost::this_thread::sleep(boost::posix_time::milliseconds(2));
+        }
+        CHECK(tree.sync());
+        copy_tree(tree, expect);
+        CHECK(tree.ckpt_done > 0);
+
+        // old logs are deleted behind checkpoints
+        CHECK(tree.checkpoint());
+        CHECK(log_gens(tree) == vector<uint64_t>(1, tree.gen));
+        CHECK(ckpt_gens(tree) == vector<uint64_t>(1, tree.gen));
+        CHECK(file_size(tree.ckpt_path(tree.gen)) > 0);
+        rand_writes(tree, 500, 2000);
+        copy_tree(tree, expect);
+    }
+
+    LTree tree(8);
+    REQUIRE(tree.open(PATH, options));
+    check_same(tree.get_tree(), expect);
+    tree.close();
+    remove_files();
+}
+
+
+TEST_CASE("wal.stale_log") {
+    remove_files();
+    GeoLogOptions options;
+    options.checkpoint_records = 0;
+
+    vector<char> stale;
+    {
+        LTree tree;
+        REQUIRE(tree.open(PATH, options));
+        tree.insert(1, 116, 40);
+        REQUIRE(tree.checkpoint());
+        tree.move(1, 116.5, 40.5);
+        tree.erase(1);
+        REQUIRE(tree.sync());
+        REQUIRE(geo_read_file(tree.log_path(2).c_str(), stale));
+        REQUIRE(tree.checkpoint());
+        tree.insert(3, 116, 40);
+        REQUIRE(tree.sync());
+    }
+
+    // crashed after the checkpoint was saved but before its logs were deleted
+    REQUIRE(geo_write_file((string(PATH) + ".log.2").c_str(), stale));
+    LTree tree;
+    REQUIRE(tree.open(PATH, options));
+    CHECK(tree.size() == 1);
+    CHECK(tree.get_tree().get_all().count(3) == 1);
+    CHECK(log_gens(tree) == vector<uint64_t>(1, tree.gen));
+    tree.close();
+    remove_files();
+}
+
+
+TEST_CASE("wal.corrupted") {
+    srand(34);
+    remove_files();
+    GeoLogOptions options;
+    options.checkpoint_records = 0;
+
+    vector<char> first;
+    string ckpt, second;
+    {
+        LTree tree(8);
+        REQUIRE(tree.open(PATH, options));
+        rand_writes(tree, 2000, 1000);
+        REQUIRE(tree.sync());
+        REQUIRE(geo_read_file(tree.log_path(1).c_str(), first));
+        tree.close();
+
+        // log 1 is replayed into a checkpoint and deleted
+        REQUIRE(tree.open(PATH, options));
+        rand_writes(tree, 2000, 1000);
+        REQUIRE(tree.sync());
+        ckpt = tree.ckpt_path(tree.gen);
+        second = tree.log_path(tree.gen);
+    }
+
+    // a bad group followed by another log was acknowledged, open fails instead of dropping both
+    REQUIRE(remove(ckpt.c_str()) == 0);
+    first[first.size() - 100] ^= 1;
+    REQUIRE(geo_write_file((string(PATH) + ".log.1").c_str(), first));
+    {
+        LTree tree(8);
+        CHECK(!tree.open(PATH, options));
+        CHECK(tree.size() == 0);
+    }
+
+    // so does a record that does not apply, here an erase of a value never inserted
+    first[first.size() - 100] ^= 1;
+    REQUIRE(geo_write_file((string(PATH) + ".log.1").c_str(), first));
+    vector<char> log;
+    REQUIRE(geo_read_file(second.c_str(), log));
+    GeoByteWriter out;
+    out.put_array(log.data(), log.size());
+    GeoByteWriter record;
+    record.put(uint8_t(LTree::OP_ERASE));
+    record.put(T(5000));
+    LTree::GroupHeader group = {
+        LTree::GROUP_MAGIC, 1, record.buf.size(), geo_checksum(record.buf.data(), record.buf.size())
+    };
+    out.put(group);
+    out.put_array(record.buf.data(), record.buf.size());
+    REQUIRE(geo_write_file(second.c_str(), out.buf));
+    {
+        LTree tree(8);
+        CHECK(!tree.open(PATH, options));
+    }
+    remove_files();
+}
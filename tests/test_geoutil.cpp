@@ -1,3 +1,6 @@
+#include <vector>
+#include <cstdlib>
+
 #include "catch.h"
 
 #include "../geoutil.hpp"
@@ -13,3 +16,49 @@ TEST_CASE("util") {
     CHECK(geo_distance(-111.382765, 39.2, -111.382765, 39.201) == Approx(111.2262999997));
     CHECK(geo_distance(-180, 0, -90, 0) == geo_distance(-180, 0, -90, 10));
 }
+
+
+TEST_CASE("distance_batch") {
+    vector<float> lons;
+    vector<float> lats;
+    srand(1);
+    for (size_t i = 0; i < 10003; ++i) {
+        lons.push_back(-180 + 360.0 * rand() / RAND_MAX);
+        lats.push_back(-85 + 170.0 * rand() / RAND_MAX);
+    }
+    // nearby points
+    for (size_t i = 0; i < 1000; ++i) {
+        lons.push_back(116.3 + 0.01 * rand() / RAND_MAX);
+        lats.push_back(39.9 + 0.01 * rand() / RAND_MAX);
+    }
+    lons.push_back(116.3);
+    lats.push_back(39.9);
+    lons.push_back(116.3 - 180);
+    lats.push_back(-39.9);
+
+    vector<uint32_t> expect(lons.size());
+    geo_distance_batch_scalar(116.3, 39.9, lons.data(), lats.data(), lons.size(), expect.data());
+
+    vector<uint32_t> got(lons.size());
+    geo_distance_batch(116.3, 39.9, lons.data(), lats.data(), lons.size(), got.data());
+    CHECK(got == expect);
+
+#ifdef GEOTOOLS_SIMD_DISPATCH
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        // tail sizes
+        for (size_t size = 0; size < 10; ++size) {
+            vector<uint32_t> avx2(size);
+            geo_distance_batch_avx2(116.3, 39.9, lons.data(), lats.data(), size, avx2.data());
+            CHECK(avx2 == vector<uint32_t>(expect.begin(), expect.begin() + size));
+        }
+        vector<uint32_t> avx2(lons.size());
+        geo_distance_batch_avx2(116.3, 39.9, lons.data(), lats.data(), lons.size(), avx2.data());
+        CHECK(avx2 == expect);
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        vector<uint32_t> avx512(lons.size());
+        geo_distance_batch_avx512(116.3, 39.9, lons.data(), lats.data(), lons.size(), avx512.data());
+        CHECK(avx512 == expect);
+    }
+#endif
+}